@@ -13,12 +13,20 @@
 // limitations under the License.
 
 #include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
 #include <iostream>
 #include <fstream>
-#include <regex>
+#include <limits>
+#include <mutex>
+#include <set>
+#include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 #include <boost/filesystem.hpp>
+#include <boost/utility/string_view.hpp>
 
 #include "m.hh"
 #include "_m.hh"
@@ -26,118 +34,478 @@
 using namespace std::literals::string_literals;
 
 namespace m {
+namespace {
+// Same characters as '\\s' in the "C" locale.
+bool is_space(char c)
+{
+  return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+}
+
+void split(boost::string_view line, std::vector<boost::string_view>& words)
+{
+  words.clear();
+  const char* p = line.data();
+  const char* end = p + line.size();
+  while(p != end)
+  {
+    while(p != end && is_space(*p))
+      ++p;
+    const char* word = p;
+    while(p != end && !is_space(*p))
+      ++p;
+    if(p != word)
+      words.emplace_back(word, p - word);
+  }
+}
+
+std::string str(boost::string_view s)
+{
+  return std::string(s.data(), s.size());
+}
+
+int number(boost::string_view s)
+{
+  std::size_t end = 0;
+  int result = -1;
+  try
+  {
+    result = std::stoi(str(s), &end);
+  }
+  catch(const std::logic_error&)
+  {}
+  if(result < 0 || end != s.size())
+    throw std::runtime_error("Not a number: " + str(s));
+  return result;
+}
+
+// A number of jobs, where "auto" is given as -1.
+int jobs(boost::string_view s)
+{
+  if(s == "auto")
+    return -1;
+  return number(s);
+}
+}
+
+struct Loader::directive
+{
+  boost::string_view name;
+  // Minimum and maximum number of words, including the directive.
+  std::size_t min;
+  std::size_t max;
+  BuilderBase& (*handler)(Loader&, BuilderBase&, const words&);
+};
+
 BuilderBase& Loader::load_file(const std::string& file, BuilderBase* initial_builder)
 {
-  const std::regex ws{"\\s+"};
-  const std::regex comment{"#.*"};
-  std::ifstream in{file};
+  std::ifstream in{file, std::ios::binary};
   if(!in)
     throw std::runtime_error("Can't open file: " + file);
+  _inputs.push_back(file);
+  const std::string buffer{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
   BuilderBase* builder = initial_builder;
   if(builder != nullptr)
     builder->project().srcs(fs::path(file).parent_path().string());
+  const Symbol input{file};
   std::string line;
+  words result;
   int line_count = 0;
-  for(std::string s; std::getline(in, s);)
+  for(std::size_t pos = 0; pos < buffer.size();)
   {
+    auto eol = buffer.find('\n', pos);
+    if(eol == std::string::npos)
+      eol = buffer.size();
+    boost::string_view s{buffer.data() + pos, eol - pos};
+    pos = eol + 1;
     ++line_count;
-    std::smatch sm;
-    if(std::regex_search(s, sm, ws) && sm.prefix().str().empty())
-      s = sm.suffix().str();
-    if(std::regex_search(s, sm, comment))
-      s = sm.prefix().str();
+    while(!s.empty() && is_space(s.front()))
+      s.remove_prefix(1);
+    auto comment = s.find('#');
+    if(comment != boost::string_view::npos)
+      s = s.substr(0, comment);
     if(s.empty())
       continue;
     if(s.back() == '\\')
     {
-      s.pop_back();
-      line += s;
+      s.remove_suffix(1);
+      line.append(s.data(), s.size());
       continue;
     }
-    line += s;
-    std::vector<std::string> result{
-      std::sregex_token_iterator(std::begin(line), std::end(line), ws, -1), {}
-    };
-    auto size = result.size();
-    const auto& directive = result[0];
-    if(directive == "project"s && size == 2)
-      builder = &ProjectBuilder::create(result[1], _topdir, _builddir);
-    else if(!builder)
-      throw std::runtime_error("First directive must be 'project'");
-    else if(directive == "ccflags"s && size >= 1)
-    {
-      for(int i = 1; i != result.size(); ++i)
-        builder = &builder->ccflags(result[i]);
-    }
-    else if(directive == "cflags"s && size >= 1)
-    {
-      for(int i = 1; i != result.size(); ++i)
-        builder = &builder->cflags(result[i]);
-    }
-    else if(directive == "ldflags"s && size >= 1)
-    {
-      for(int i = 1; i != result.size(); ++i)
-        builder = &builder->ldflags(result[i]);
-    }
-    else if(directive == "incs"s && size == 2)
-      builder = &builder->incs(result[1]);
-    else if(directive == "libs"s && size == 2)
-      builder = &builder->libs(result[1]);
-    else if(directive == "srcs"s && size == 2)
-      builder = &builder->srcs(result[1]);
-    else if(directive == "ext"s && size == 2)
-      builder = &builder->ext(result[1]);
-    else if(directive == "url"s && size == 3)
-      builder = &builder->url(result[1], result[2]);
-    else if(directive == "lib"s && size == 2)
-      builder = &builder->lib(result[1]);
-    else if(directive == "lib"s && size == 3)
-      builder = &builder->lib(result[1], result[2]);
-    else if(directive == "frameworks"s && size == 3)
-      builder = &builder->frameworks(result[1], result[2]);
-    else if(directive == "bin"s && size == 2)
-      builder = &builder->bin(result[1]);
-    else if(directive == "add"s)
-    {
-      const auto& sub = result[1];
-      if(sub == "src"s && size == 3)
-        builder = &builder->add_src(result[2]);
-      else if(sub == "lib"s && size == 3)
-        builder = &builder->add_lib(result[2]);
-      else if(sub == "lib"s && size == 4)
-        builder = &builder->add_lib(result[2], result[3]);
-      else if(sub == "framework"s && size == 4)
-        builder = &builder->add_framework(result[2], result[3]);
-      else if(sub == "def"s && size == 3)
-        builder = &builder->add_def(result[2]);
-    }
-    else if(directive == "load"s && size == 2)
-      builder = &load_file(result[1], builder);
-    else if(directive == "subdirs"s && size == 2)
-    {
-      std::set<std::string> list;
-      find_files(result[1], "_m", list);
-      for(auto _m: list)
-        builder = &load_file(_m, builder);
-    }
+    if(line.empty())
+      split(s, result);
     else
     {
-      std::cerr << "Illegal directive line " << line_count << ":";
-      for(auto& i: result)
-        std::cerr << " " << i;
-      std::cerr << std::endl;
+      line.append(s.data(), s.size());
+      split(line, result);
     }
+    // Set for every line since 'load' and 'subdirs' change it while
+    // loading another file.
+    if(builder != nullptr)
+      builder->project().input(input);
+    builder = &dispatch(builder, result, line_count);
     line.clear();
   }
   return *builder;
 }
 
+BuilderBase& Loader::dispatch(BuilderBase* builder, const words& result, int line_count)
+{
+  static const auto any = std::numeric_limits<std::size_t>::max();
+  static const directive directives[] =
+  {
+    {"ccflags", 1, any, [](Loader&, BuilderBase& b, const words& w) -> BuilderBase& {
+        for(std::size_t i = 1; i != w.size(); ++i)
+          b.ccflags(str(w[i]));
+        return b;
+      }},
+    {"cflags", 1, any, [](Loader&, BuilderBase& b, const words& w) -> BuilderBase& {
+        for(std::size_t i = 1; i != w.size(); ++i)
+          b.cflags(str(w[i]));
+        return b;
+      }},
+    {"ldflags", 1, any, [](Loader&, BuilderBase& b, const words& w) -> BuilderBase& {
+        for(std::size_t i = 1; i != w.size(); ++i)
+          b.ldflags(str(w[i]));
+        return b;
+      }},
+    {"incs", 2, 2, [](Loader&, BuilderBase& b, const words& w) -> BuilderBase& {
+        return b.incs(str(w[1]));
+      }},
+    {"libs", 2, 2, [](Loader&, BuilderBase& b, const words& w) -> BuilderBase& {
+        return b.libs(str(w[1]));
+      }},
+    {"srcs", 2, 2, [](Loader&, BuilderBase& b, const words& w) -> BuilderBase& {
+        return b.srcs(str(w[1]));
+      }},
+    {"ext", 2, 2, [](Loader&, BuilderBase& b, const words& w) -> BuilderBase& {
+        return b.ext(str(w[1]));
+      }},
+    {"pch", 2, 2, [](Loader&, BuilderBase& b, const words& w) -> BuilderBase& {
+        return b.pch(str(w[1]));
+      }},
+    {"unity", 2, 2, [](Loader&, BuilderBase& b, const words& w) -> BuilderBase& {
+        return b.unity(number(w[1]));
+      }},
+    {"nounity", 2, any, [](Loader&, BuilderBase& b, const words& w) -> BuilderBase& {
+        for(std::size_t i = 1; i != w.size(); ++i)
+          b.nounity(str(w[i]));
+        return b;
+      }},
+    {"launcher", 2, 2, [](Loader&, BuilderBase& b, const words& w) -> BuilderBase& {
+        return b.launcher(str(w[1]));
+      }},
+    {"link_launcher", 2, 2, [](Loader&, BuilderBase& b, const words& w) -> BuilderBase& {
+        return b.link_launcher(str(w[1]));
+      }},
+    {"cache_dir", 2, 2, [](Loader&, BuilderBase& b, const words& w) -> BuilderBase& {
+        return b.cache_dir(str(w[1]));
+      }},
+    {"compile_jobs", 2, 2, [](Loader&, BuilderBase& b, const words& w) -> BuilderBase& {
+        return b.compile_jobs(jobs(w[1]));
+      }},
+    {"link_jobs", 2, 2, [](Loader&, BuilderBase& b, const words& w) -> BuilderBase& {
+        return b.link_jobs(jobs(w[1]));
+      }},
+    {"pool", 2, 2, [](Loader&, BuilderBase& b, const words& w) -> BuilderBase& {
+        return b.pool(str(w[1]));
+      }},
+    {"pool", 3, 3, [](Loader&, BuilderBase& b, const words& w) -> BuilderBase& {
+        return b.pool(str(w[1]), number(w[2]));
+      }},
+    {"variant", 2, 2, [](Loader&, BuilderBase& b, const words& w) -> BuilderBase& {
+        return b.variant(str(w[1]));
+      }},
+    {"type", 2, 2, [](Loader&, BuilderBase& b, const words& w) -> BuilderBase& {
+        return b.type(str(w[1]));
+      }},
+    {"visibility", 2, 2, [](Loader&, BuilderBase& b, const words& w) -> BuilderBase& {
+        return b.visibility(str(w[1]));
+      }},
+    {"time_trace", 1, 1, [](Loader&, BuilderBase& b, const words&) -> BuilderBase& {
+        return b.time_trace();
+      }},
+    {"reproducible", 1, 1, [](Loader&, BuilderBase& b, const words&) -> BuilderBase& {
+        return b.reproducible();
+      }},
+    {"link_profile", 2, 2, [](Loader&, BuilderBase& b, const words& w) -> BuilderBase& {
+        return b.link_profile(str(w[1]));
+      }},
+    {"lto", 2, 2, [](Loader&, BuilderBase& b, const words& w) -> BuilderBase& {
+        return b.lto(str(w[1]));
+      }},
+    {"url", 3, 3, [](Loader&, BuilderBase& b, const words& w) -> BuilderBase& {
+        return b.url(str(w[1]), str(w[2]));
+      }},
+    {"url", 4, 4, [](Loader&, BuilderBase& b, const words& w) -> BuilderBase& {
+        return b.url(str(w[1]), str(w[2]), str(w[3]));
+      }},
+    {"sparse", 2, any, [](Loader&, BuilderBase& b, const words& w) -> BuilderBase& {
+        for(std::size_t i = 1; i != w.size(); ++i)
+          b.sparse(str(w[i]));
+        return b;
+      }},
+    {"lib", 2, 2, [](Loader&, BuilderBase& b, const words& w) -> BuilderBase& {
+        return b.lib(str(w[1]));
+      }},
+    {"lib", 3, 3, [](Loader&, BuilderBase& b, const words& w) -> BuilderBase& {
+        return b.lib(str(w[1]), str(w[2]));
+      }},
+    {"frameworks", 3, 3, [](Loader&, BuilderBase& b, const words& w) -> BuilderBase& {
+        return b.frameworks(str(w[1]), str(w[2]));
+      }},
+    {"bin", 2, 2, [](Loader&, BuilderBase& b, const words& w) -> BuilderBase& {
+        return b.bin(str(w[1]));
+      }},
+    {"add", 2, any, [](Loader& l, BuilderBase& b, const words& w) -> BuilderBase& {
+        return l.add(b, w);
+      }},
+    {"load", 2, 2, [](Loader& l, BuilderBase& b, const words& w) -> BuilderBase& {
+        return l.load_file(str(w[1]), &b);
+      }},
+    {"ignore", 2, any, [](Loader& l, BuilderBase& b, const words& w) -> BuilderBase& {
+        for(std::size_t i = 1; i != w.size(); ++i)
+          l._scanner.ignore(str(w[i]));
+        return b;
+      }},
+    {"subdirs", 2, 2, [](Loader& l, BuilderBase& b, const words& w) -> BuilderBase& {
+        std::set<std::string> list;
+        l.find_files(str(w[1]), "_m", list);
+        BuilderBase* builder = &b;
+        for(auto _m: list)
+          builder = &l.load_file(_m, builder);
+        return *builder;
+      }},
+  };
+  const auto& name = result[0];
+  auto size = result.size();
+  if(name == "project" && size == 2)
+    return ProjectBuilder::create(str(result[1]), _topdir, _builddir);
+  if(!builder)
+    throw std::runtime_error("First directive must be 'project'");
+  for(const auto& d: directives)
+    if(d.name == name && size >= d.min && size <= d.max)
+      return d.handler(*this, *builder, result);
+  std::cerr << "Illegal directive line " << line_count << ":";
+  for(auto& i: result)
+    std::cerr << " " << i;
+  std::cerr << std::endl;
+  return *builder;
+}
+
+// Unknown 'add' directives are silently ignored.
+BuilderBase& Loader::add(BuilderBase& builder, const words& result)
+{
+  static const directive directives[] =
+  {
+    {"src", 3, 3, [](Loader&, BuilderBase& b, const words& w) -> BuilderBase& {
+        return b.add_src(str(w[2]));
+      }},
+    {"lib", 3, 3, [](Loader&, BuilderBase& b, const words& w) -> BuilderBase& {
+        return b.add_lib(str(w[2]));
+      }},
+    {"lib", 4, 4, [](Loader&, BuilderBase& b, const words& w) -> BuilderBase& {
+        return b.add_lib(str(w[2]), str(w[3]));
+      }},
+    {"framework", 4, 4, [](Loader&, BuilderBase& b, const words& w) -> BuilderBase& {
+        return b.add_framework(str(w[2]), str(w[3]));
+      }},
+    {"def", 3, 3, [](Loader&, BuilderBase& b, const words& w) -> BuilderBase& {
+        return b.add_def(str(w[2]));
+      }},
+  };
+  auto size = result.size();
+  for(const auto& d: directives)
+    if(d.name == result[1] && size >= d.min && size <= d.max)
+      return d.handler(*this, builder, result);
+  return builder;
+}
+
 void Loader::find_files(const fs::path& dir, const std::string& file, std::set<std::string>& result)
 {
   if(!fs::exists(dir))
     return;
-  for(auto d: fs::recursive_directory_iterator(dir))
-    if(fs::is_regular_file(d.status()) && d.path().filename() == file)
-      result.insert(d.path().string());
+  // Record the directories as well so that adding a new file is
+  // noticed.
+  std::vector<std::string> dirs;
+  _scanner.find(dir, file, result, dirs);
+  for(const auto& d: dirs)
+    _directories.push_back(d);
+}
+
+namespace {
+const std::string scan_magic{"m-scan 1"};
+
+std::string normalize(const fs::path& dir)
+{
+  return fs::absolute(dir).lexically_normal().string();
+}
+}
+
+Scanner::Scanner(const std::string& topdir, const std::string& builddir)
+  : _topdir(topdir), _cache_file(fs::path(builddir) / ".m" / "scan"),
+    _start(std::time(nullptr)), _ignore_names{".git", ".hg", ".svn", ".externals"},
+    _ignore_paths{normalize(builddir)}, _loaded(false), _cache_time(0)
+{}
+
+void Scanner::ignore(const std::string& dir)
+{
+  if(dir.find('/') == std::string::npos)
+    _ignore_names.insert(dir);
+  else
+    _ignore_paths.insert(normalize(fs::path(_topdir) / dir));
+}
+
+bool Scanner::ignored(const fs::path& dir) const
+{
+  return _ignore_names.count(dir.filename().string()) != 0
+    || _ignore_paths.count(normalize(dir)) != 0;
+}
+
+void Scanner::load(const std::string& file)
+{
+  if(_loaded)
+    return;
+  _loaded = true;
+  _file = file;
+  std::ifstream in{_cache_file.string()};
+  std::string line;
+  if(!std::getline(in, line) || line != scan_magic + " " + file)
+    return;
+  directory* current = nullptr;
+  while(std::getline(in, line))
+  {
+    std::istringstream is{line};
+    std::string key;
+    is >> key;
+    if(key == "time"s)
+      is >> _cache_time;
+    else if(key == "dir"s)
+    {
+      directory d;
+      is >> d.mtime >> d.has_file;
+      std::string path;
+      std::getline(is >> std::ws, path);
+      current = &_cache[path];
+      *current = d;
+    }
+    else if(key == "sub"s && current)
+      current->subdirs.push_back(line.substr(key.size() + 1));
+    else
+    {
+      _cache.clear();
+      return;
+    }
+  }
+}
+
+void Scanner::save() const
+{
+  boost::system::error_code ec;
+  fs::create_directories(_cache_file.parent_path(), ec);
+  auto tmp = _cache_file;
+  tmp += ".tmp";
+  std::ofstream out{tmp.string()};
+  if(!out)
+    return;
+  out << scan_magic << ' ' << _file << '\n';
+  out << "time " << _start << '\n';
+  for(const auto& d: _scanned)
+  {
+    out << "dir " << d.second.mtime << ' ' << d.second.has_file << ' ' << d.first << '\n';
+    for(const auto& sub: d.second.subdirs)
+      out << "sub " << sub << '\n';
+  }
+  out.close();
+  fs::rename(tmp, _cache_file, ec);
+}
+
+Scanner::directory Scanner::scan(const fs::path& dir, const std::string& file) const
+{
+  boost::system::error_code ec;
+  auto mtime = fs::last_write_time(dir, ec);
+  auto i = _cache.find(dir.string());
+  // A directory changed in the same second as the cache was saved may
+  // have changed again without its mtime changing.
+  if(!ec && i != _cache.end() && i->second.mtime == mtime && mtime < _cache_time)
+    return i->second;
+  directory result{mtime, false, {}};
+  // Entries which can't be read, or which disappear while scanning,
+  // are skipped.
+  for(fs::directory_iterator d(dir, ec), end; !ec && d != end; d.increment(ec))
+  {
+    boost::system::error_code status_ec;
+    if(fs::is_directory(d->symlink_status(status_ec)))
+      result.subdirs.push_back(d->path().filename().string());
+    else if(d->path().filename() == file && fs::is_regular_file(d->status(status_ec)))
+      result.has_file = true;
+  }
+  std::sort(result.subdirs.begin(), result.subdirs.end());
+  return result;
+}
+
+void Scanner::find(const fs::path& dir, const std::string& file, std::set<std::string>& result,
+  std::vector<std::string>& dirs)
+{
+  if(_loaded && file != _file)
+    throw std::runtime_error("Scanner: can only search for one file name");
+  load(file);
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<fs::path> queue{dir};
+  std::size_t busy = 0;
+  std::vector<std::string> visited;
+  // The first error in any of the threads, thrown once all of them
+  // have finished.
+  std::exception_ptr error;
+  auto worker = [&]() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while(true)
+    {
+      cv.wait(lock, [&]() { return !queue.empty() || busy == 0; });
+      if(queue.empty())
+        return;
+      auto current = queue.front();
+      queue.pop_front();
+      ++busy;
+      lock.unlock();
+      directory entry;
+      std::vector<fs::path> subdirs;
+      try
+      {
+        entry = scan(current, file);
+        for(const auto& sub: entry.subdirs)
+          if(!ignored(current / sub))
+            subdirs.push_back(current / sub);
+      }
+      catch(...)
+      {
+        lock.lock();
+        if(!error)
+          error = std::current_exception();
+        --busy;
+        cv.notify_all();
+        continue;
+      }
+      lock.lock();
+      queue.insert(queue.end(), subdirs.begin(), subdirs.end());
+      if(entry.has_file)
+        result.insert((current / file).string());
+      visited.push_back(current.string());
+      _scanned[current.string()] = std::move(entry);
+      --busy;
+      cv.notify_all();
+    }
+  };
+  std::vector<std::thread> threads;
+  for(unsigned i = 1; i < std::thread::hardware_concurrency(); ++i)
+    threads.emplace_back(worker);
+  worker();
+  for(auto& t: threads)
+    t.join();
+  if(error)
+    std::rethrow_exception(error);
+  std::sort(visited.begin(), visited.end());
+  dirs.insert(dirs.end(), visited.begin(), visited.end());
+  save();
 }
 }
@@ -14,23 +14,80 @@
 
 #pragma once
 
+#include <ctime>
 #include <iostream>
+#include <map>
+#include <set>
 #include <boost/filesystem.hpp>
+#include <boost/utility/string_view.hpp>
 #include "m.hh"
 
 namespace fs = boost::filesystem;
 
 namespace m {
+// Finds files with a given name in a directory tree for the 'subdirs'
+// directive.  Version control directories, '.externals', the build
+// directory and anything given with 'ignore' are skipped.
+// Subdirectories are scanned in parallel and what was found in each
+// directory is cached in $builddir/.m/scan together with the
+// directory's mtime so that unchanged directories are not read again.
+class Scanner
+{
+  public:
+    Scanner(const std::string& topdir, const std::string& builddir);
+    // Ignore directories with this name, or this path relative to
+    // topdir if it contains a slash.
+    void ignore(const std::string& dir);
+    // Adds the matching files to 'result' and every directory scanned
+    // to 'dirs'.
+    void find(const fs::path& dir, const std::string& file, std::set<std::string>& result,
+      std::vector<std::string>& dirs);
+  private:
+    struct directory
+    {
+      std::time_t mtime;
+      bool has_file;
+      std::vector<std::string> subdirs;
+    };
+    void load(const std::string& file);
+    void save() const;
+    directory scan(const fs::path& dir, const std::string& file) const;
+    bool ignored(const fs::path& dir) const;
+    const std::string _topdir;
+    const fs::path _cache_file;
+    const std::time_t _start;
+    std::set<std::string> _ignore_names;
+    std::set<std::string> _ignore_paths;
+    std::string _file;
+    bool _loaded;
+    // Directories read from the cache and the time it was saved.
+    std::map<std::string, directory> _cache;
+    std::time_t _cache_time;
+    // Directories scanned by this run.
+    std::map<std::string, directory> _scanned;
+};
+
 class Loader
 {
   public:
     Loader(const std::string& topdir = ".", const std::string& builddir = "build")
-      : _topdir(topdir), _builddir(builddir)
+      : _topdir(topdir), _builddir(builddir), _scanner(topdir, builddir)
     {}
     BuilderBase& load_file(const std::string& file, BuilderBase* initial_builder = nullptr);
+    // All files read while loading, in the order read.
+    const std::vector<std::string>& inputs() const { return _inputs.vector(); }
+    // The directories searched for '_m' files by 'subdirs'.
+    const std::vector<std::string>& directories() const { return _directories.vector(); }
   private:
+    using words = std::vector<boost::string_view>;
+    struct directive;
+    BuilderBase& dispatch(BuilderBase* builder, const words& result, int line_count);
+    BuilderBase& add(BuilderBase& builder, const words& result);
     void find_files(const fs::path& dir, const std::string& file, std::set<std::string>& result);
     const std::string _topdir;
     const std::string _builddir;
+    unique_vector<std::string> _inputs;
+    unique_vector<std::string> _directories;
+    Scanner _scanner;
 };
 }
@@ -12,19 +12,78 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <atomic>
+#include <chrono>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <string>
 #include <iostream>
 #include <fstream>
+#include <iomanip>
+#include <limits>
+#include <mutex>
+#include <unordered_set>
+#include <sstream>
+#include <thread>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include <boost/filesystem.hpp>
 #include <boost/process.hpp>
 #include "m.hh"
 #include "_m.hh"
+#include "report.hh"
+#include "state.hh"
 
 using namespace std::literals::string_literals;
 namespace fs = boost::filesystem;
 namespace bp = boost::process;
 
 namespace m {
+// Symbols are only created while loading, which is single threaded.
+const std::string& Symbol::intern(const std::string& s)
+{
+  static std::unordered_set<std::string> symbols;
+  // Most strings are already interned so look before inserting.
+  auto i = symbols.find(s);
+  if(i != symbols.end())
+    return *i;
+  return *symbols.insert(s).first;
+}
+
+bool write_if_changed(const std::string& file, const std::string& content)
+{
+  {
+    std::ifstream in{file, std::ios::binary | std::ios::ate};
+    if(in && static_cast<std::size_t>(in.tellg()) == content.size())
+    {
+      std::string current(content.size(), '\0');
+      in.seekg(0);
+      if(in.read(&current[0], current.size()) && current == content)
+        return false;
+    }
+  }
+  fs::path path{file};
+  if(path.has_parent_path())
+    fs::create_directories(path.parent_path());
+  auto tmp = file + ".tmp";
+  std::ofstream out{tmp, std::ios::binary};
+  if(!out)
+    throw std::runtime_error("Can't open " + tmp + " for writing");
+  out.write(content.data(), content.size());
+  out.close();
+  if(!out)
+    throw std::runtime_error("Can't write " + tmp);
+  fs::rename(tmp, path);
+  return true;
+}
+
 const std::string& Object::extension(const Project& project) const
 {
   if(!_extension.empty())
@@ -37,37 +96,606 @@ const std::string& Object::src_path() const
   return _source_path;
 }
 
-void Library::fetch(const Project& project) const
+const std::string& Object::pch(const Project& project) const
+{
+  if(!_pch.empty())
+    return _pch;
+  return project.pch();
+}
+
+namespace {
+#ifdef __APPLE__
+const std::string shared_extension{".dylib"};
+#else
+const std::string shared_extension{".so"};
+#endif
+}
+
+#ifdef __APPLE__
+const std::string Binary::rpath{"-Wl,-rpath,@loader_path/../lib"};
+#else
+const std::string Binary::rpath{"-Wl,-rpath,'$$ORIGIN/../lib'"};
+#endif
+
+Library::Type Library::type(const Project& project) const
 {
-  if(_external)
-    project.fetch(name(), _external->url(), _external->hash());
+  if(_type != Type::DEFAULT)
+    return _type;
+  return project.type();
+}
+
+std::string Library::file(const Project& project) const
+{
+  if(type(project) == Type::SHARED)
+    return "lib" + name() + shared_extension;
+  if(type(project) == Type::OBJECTS)
+    return "lib" + name();
+  return "lib" + name() + ".a";
+}
+
+std::string Library::dependency(const Project& project) const
+{
+  if(type(project) == Type::SHARED)
+    return "$builddir/lib/" + file(project) + ".toc";
+  return "$builddir/lib/" + file(project);
+}
+
+std::string Library::soflags(const Project& project) const
+{
+  if(type(project) == Type::OBJECTS)
+  {
+    // The objects end up in any shared library depending on this one.
+    for(const auto& l: project.libraries())
+      if(l->type(project) == Type::SHARED)
+      {
+        const auto& dependencies = l->dependencies();
+        if(std::find(dependencies.begin(), dependencies.end(), this) != dependencies.end())
+          return "-fPIC";
+      }
+    return {};
+  }
+  if(type(project) != Type::SHARED)
+    return {};
+  const auto& visibility = _visibility.empty() ? project.visibility() : _visibility.str();
+  if(visibility.empty() || visibility == "default"s)
+    return "-fPIC";
+  auto flags = "-fPIC -fvisibility=" + visibility;
+  if(extension(project) != ".c"s)
+    flags += " -fvisibility-inlines-hidden";
+  return flags;
+}
+
+// The interface stub lists the exported symbols of the shared
+// library.  With restat binaries are only relinked when it changes.
+void Library::generate_shared(std::ostream& out, const Project& project) const
+{
+  auto lib = "$builddir/lib/" + file(project);
+  // Link with the libraries this one depends on so that the dynamic
+  // linker loads them even if a binary doesn't use them directly.
+  unique_vector<std::string> libs_v;
+  unique_vector<Symbol> libsearch_v;
+  unique_vector<std::string> deps_v;
+  unique_vector<std::string> shared_v;
+  const auto& dependencies = this->dependencies();
+  std::vector<std::string> objects_v;
+  for(auto i = dependencies.rbegin(); i != dependencies.rend(); ++i)
+  {
+    const auto& l = *i;
+    if(l->header_only())
+      continue;
+    if(l->compiled() && l->type(project) == Type::OBJECTS)
+    {
+      for(const auto& o: l->objects(project))
+        objects_v.push_back(o);
+      continue;
+    }
+    libs_v.push_back(l->name());
+    for(const auto& path: l->library_path())
+      libsearch_v.push_back(path);
+    if(l->compiled())
+    {
+      deps_v.push_back(l->dependency(project));
+      if(l->type(project) == Type::SHARED)
+        shared_v.push_back("$builddir/lib/" + l->file(project));
+    }
+  }
+  out << "build " << lib << ": LINK.so";
+  for(const auto& i: objects(project))
+    out << " " << i;
+  for(const auto& i: objects_v)
+    out << " " << i;
+  if(!deps_v.vector().empty())
+    out << " |";
+  for(const auto& i: deps_v.vector())
+    out << " " << i;
+  if(!shared_v.vector().empty())
+    out << " ||";
+  for(const auto& i: shared_v.vector())
+    out << " " << i;
+  out << '\n';
+  print(libsearch_v.vector(), out, " -L =", [&out](const auto& s) { out << " -L" << s; });
+  print(libs_v.vector(), out, " -l =", [&out](const auto& s) { out << " -l" << s; });
+  if(!shared_v.vector().empty())
+#ifdef __APPLE__
+    out << " rpath = -Wl,-rpath,@loader_path\n";
+#else
+    out << " rpath = -Wl,-rpath,'$$ORIGIN'\n";
+#endif
+#ifdef __APPLE__
+  out << " soname = -Wl,-install_name,@rpath/" << file(project) << '\n';
+#else
+  out << " soname = -Wl,-soname," << file(project) << '\n';
+#endif
+  print(_ldflags, out, " ldflags =", [&out](const auto& s) { out << " " << s; });
+  const auto& link_pool = pool(project, true);
+  if(!link_pool.empty())
+    out << " pool = " << link_pool << '\n';
+  out << "build " << lib << ".toc: TOC " << lib << '\n';
+}
+
+const std::vector<const Library*>& Object::dependencies() const
+{
+  std::vector<const Object*> path;
+  return dependencies(path);
+}
+
+// A depth first search over the 'add lib' edges.  The dependencies of
+// each library are resolved once and merged in order, so every
+// library still comes after its own dependencies.
+const std::vector<const Library*>& Object::dependencies(std::vector<const Object*>& path) const
+{
+  if(_visit == Visit::DONE)
+    return _dependencies;
+  if(_visit == Visit::ACTIVE)
+  {
+    std::string cycle;
+    for(auto i = std::find(path.begin(), path.end(), this); i != path.end(); ++i)
+      cycle += (*i)->name() + " -> ";
+    throw std::runtime_error("Library dependency cycle: " + cycle + name());
+  }
+  _visit = Visit::ACTIVE;
+  path.push_back(this);
+  unique_vector<const Library*> dependencies_v;
+  for(const auto& l: _libraries)
+  {
+    for(const auto& d: l->dependencies(path))
+      dependencies_v.push_back(d);
+    dependencies_v.push_back(l);
+  }
+  _dependencies = dependencies_v.vector();
+  path.pop_back();
+  _visit = Visit::DONE;
+  return _dependencies;
+}
+
+std::vector<Symbol> Object::dependency_includes() const
+{
+  unique_vector<Symbol> includes_v;
+  for(const auto& l: _libraries)
+    for(const auto& inc: l->include_path())
+      includes_v.push_back(inc);
+  const auto& dependencies = this->dependencies();
+  for(auto l = dependencies.rbegin(); l != dependencies.rend(); ++l)
+    for(const auto& inc: (*l)->include_path())
+      includes_v.push_back(inc);
+  return includes_v.vector();
+}
+
+std::string Object::pch_file(const Project& project) const
+{
+  const auto& header = pch(project);
+  if(header.empty())
+    return {};
+  return "$builddir/pch/"s + name() + "/" + fs::path(header).filename().string()
+    + (project.toolchain().clang() ? ".pch" : ".gch");
+}
+
+int Object::unity(const Project& project) const
+{
+  if(_unity >= 0)
+    return _unity;
+  return project.unity();
+}
+
+const std::string& Object::pool(const Project& project, bool link) const
+{
+  if(!_pool.empty())
+  {
+    if(!project.has_pool(_pool))
+      throw std::runtime_error("pool: unknown pool '" + _pool + "' in " + name());
+    return _pool;
+  }
+  return link ? project.link_pool() : project.compile_pool();
+}
+
+void Object::partition(const Project& project, std::vector<Symbol>& single,
+  std::vector<std::vector<Symbol>>& groups) const
+{
+  std::size_t size = std::max(unity(project), 0);
+  for(const auto& i: _sources)
+  {
+    if(size < 2 || std::find(_nounity.begin(), _nounity.end(), i) != _nounity.end())
+      single.push_back(i);
+    else
+    {
+      if(groups.empty() || groups.back().size() == size)
+        groups.emplace_back();
+      groups.back().push_back(i);
+    }
+  }
+  // Nothing is gained by wrapping a single source.
+  if(!groups.empty() && groups.back().size() == 1)
+  {
+    single.push_back(groups.back().front());
+    groups.pop_back();
+  }
+}
+
+void Object::digest(Digest& digest, const Project& project) const
+{
+  digest << name() << _ccflags << _cflags << _ldflags << defines() << include_path()
+    << library_path() << src_path() << extension(project) << pch(project)
+    << pch_file(project) << static_cast<std::uint64_t>(unity(project)) << _nounity
+    << pool(project, false) << pool(project, true) << _sources << soflags(project)
+    << _header_only << _compiled << static_cast<std::uint64_t>(_libraries.size());
+  for(const auto& l: _libraries)
+    digest << l->name();
+}
+
+void Library::digest(Digest& digest, const Project& project) const
+{
+  Object::digest(digest, project);
+  digest << static_cast<std::uint64_t>(type(project)) << file(project);
+}
+
+void Binary::digest(Digest& digest, const Project& project) const
+{
+  Object::digest(digest, project);
+  for(const auto& f: _frameworks)
+    digest << f.first->path() << f.second;
+}
+
+std::vector<std::string> Object::objects(const Project& project) const
+{
+  std::vector<Symbol> single;
+  std::vector<std::vector<Symbol>> groups;
+  partition(project, single, groups);
+  std::vector<std::string> result;
+  for(const auto& i: single)
+    result.push_back("$builddir/obj/" + name() + "/" + i + ".o");
+  for(std::size_t i = 0; i != groups.size(); ++i)
+    result.push_back("$builddir/obj/" + name() + "/unity/" + std::to_string(i) + ".o");
+  return result;
+}
+
+namespace {
+// The bindings of a rule in the preamble, in order.
+const std::vector<std::pair<std::string, std::string>>& preamble_rule(const std::string& name)
+{
+  static std::map<std::string, std::vector<std::pair<std::string, std::string>>> rules;
+  auto& bindings = rules[name];
+  if(!bindings.empty())
+    return bindings;
+  const auto& text = preamble[1];
+  auto pos = text.find("rule " + name + "\n");
+  if(pos == std::string::npos)
+    throw std::runtime_error("Unknown rule " + name);
+  pos = text.find('\n', pos) + 1;
+  while(pos < text.size() && text[pos] == ' ')
+  {
+    auto end = std::min(text.find('\n', pos), text.size());
+    auto eq = text.find(" = ", pos);
+    bindings.emplace_back(text.substr(pos + 1, eq - pos - 1), text.substr(eq + 3, end - eq - 3));
+    pos = end + 1;
+  }
+  return bindings;
+}
+
+// Ninja only allows letters, digits, '_', '-' and '.' in rule names.
+std::string rule_name(const std::string& rule, const std::string& target)
+{
+  static const char hex[] = "0123456789abcdef";
+  auto name = rule + ".";
+  for(unsigned char c: target)
+  {
+    if(std::isalnum(c) || c == '-' || c == '.')
+      name += c;
+    else
+    {
+      name += '_';
+      name += hex[c >> 4];
+      name += hex[c & 15];
+    }
+  }
+  return name;
+}
+}
+
+void Object::generate_sources(std::ostream& out, const Project& project,
+  const std::vector<Symbol>& defines, const std::vector<Symbol>& includes,
+  const std::vector<Symbol>& framework_path) const
+{
+  const auto& ext = extension(project);
+  const auto& compile = rule(ext);
+  // The variables set for each compile edge of this target.
+  std::vector<std::pair<std::string, std::string>> bindings;
+  auto bind = [&bindings](const std::string& name, const auto& values, auto f) {
+    if(values.empty())
+      return;
+    std::string value;
+    for(const auto& s: values)
+    {
+      if(!value.empty())
+        value += ' ';
+      value += f(s);
+    }
+    bindings.emplace_back(name, value);
+  };
+  auto same = [](const Symbol& s) { return s.str(); };
+  bind("ccflags", _ccflags, same);
+  bind("cflags", _cflags, same);
+  bind("-D", defines, same);
+  bind("-I", includes,
+    [](const Symbol& s) { return s[0] == '/' ? "-I" + s : "-I$topdir/" + s; });
+  bind("-F", framework_path, [](const Symbol& s) { return "-F" + s; });
+  auto so = soflags(project);
+  if(!so.empty())
+    bindings.emplace_back("soflags", so);
+  auto flags_to = [&bindings](std::ostream& out) {
+    for(const auto& b: bindings)
+      out << " " << b.first << " = " << b.second << '\n';
+  };
+  auto flags = [&]() { flags_to(out); };
+  // The precompiled header is built with exactly the same flags as
+  // the sources using it.  GCC finds <header>.gch when including
+  // <header> while Clang is given the .pch file directly.  ccache
+  // only caches compiles using a .gch if the preprocessor output
+  // refers to it, which GCC does with -fpch-preprocess.
+  auto pch_file = this->pch_file(project);
+  std::string pch_flag;
+  const auto& header = pch(project);
+  if(!header.empty())
+  {
+    bool clang = project.toolchain().clang();
+    pch_flag = clang ? "-include-pch " + pch_file : "-include " + fs::path(pch_file).replace_extension().string();
+    if(!clang && project.has_launcher())
+      pch_flag += " -fpch-preprocess";
+    out << "build " << pch_file << ": PCH" << compile.substr(compile.find('.'))
+      << (header[0] == '/' ? " " : " $topdir/") << header << '\n';
+    flags();
+    if(!pool(project, false).empty())
+      out << " pool = " << pool(project, false) << '\n';
+  }
+  auto compile_pool = pool(project, false);
+  std::string src = src_path();
+  if(!src.empty())
+    src += '/';
+  std::vector<Symbol> single;
+  std::vector<std::vector<Symbol>> groups;
+  partition(project, single, groups);
+  // A target with more than one compile edge gets a rule of its own
+  // with its flags written into the command, so that they're only
+  // written once.  The commands are the same as with the bindings on
+  // each edge.  The rule is only used if it makes build.ninja
+  // smaller, i.e. if the bindings it saves on every edge outweigh the
+  // rule itself and the longer rule name on every edge.
+  auto edge_rule = compile;
+  auto edges = single.size() + groups.size();
+  if((!bindings.empty() || !pch_flag.empty() || !compile_pool.empty()) && edges > 1)
+  {
+    std::ostringstream saved;
+    flags_to(saved);
+    if(!pch_flag.empty())
+      saved << " pch = " << pch_flag << '\n';
+    if(!compile_pool.empty())
+      saved << " pool = " << compile_pool << '\n';
+    auto target_rule = rule_name(compile, name());
+    auto with_rule = bindings;
+    if(!pch_flag.empty())
+      with_rule.emplace_back("pch", pch_flag);
+    std::ostringstream text;
+    text << "rule " << target_rule << '\n';
+    for(const auto& r: preamble_rule(compile))
+    {
+      text << " " << r.first << " =";
+      if(r.first != "command"s)
+      {
+        text << " " << r.second << '\n';
+        continue;
+      }
+      // Words of the form '$name' or '${name}' are replaced by the
+      // value bound to 'name', compared in place since there are
+      // thousands of these rules in large projects.
+      const auto& command = r.second;
+      std::size_t pos = 0;
+      while(pos <= command.size())
+      {
+        auto end = std::min(command.find(' ', pos), command.size());
+        auto first = pos + 1;
+        auto last = end;
+        if(first < last && command[first] == '{' && command[last - 1] == '}')
+        {
+          ++first;
+          --last;
+        }
+        auto b = with_rule.end();
+        if(pos < end && command[pos] == '$')
+          b = std::find_if(with_rule.begin(), with_rule.end(), [&](const auto& b) {
+              return command.compare(first, last - first, b.first) == 0;
+            });
+        text << ' ';
+        if(b == with_rule.end())
+          text.write(command.data() + pos, end - pos);
+        else
+          text << b->second;
+        pos = end + 1;
+      }
+      text << '\n';
+    }
+    if(!compile_pool.empty())
+      text << " pool = " << compile_pool << '\n';
+    auto definition = text.str();
+    if(definition.size() + edges * (target_rule.size() - compile.size()) < edges * saved.str().size())
+    {
+      out << definition;
+      edge_rule = target_rule;
+      bindings.clear();
+      pch_flag.clear();
+      compile_pool.clear();
+    }
+  }
+  // With split DWARF the compiler also writes <object>.dwo, and the
+  // time trace goes to <object>.json.
+  bool dwo = project.split_dwarf();
+  bool trace = project.time_trace();
+  bool seed = project.random_seed();
+  auto build = [&](const std::string& object, const std::string& source) {
+    out << "build " << object;
+    auto base = object.substr(0, object.size() - 2);
+    if(dwo || trace)
+      out << " |";
+    if(dwo)
+      out << " " << base << ".dwo";
+    if(trace)
+      out << " " << base << ".json";
+    out << ": " << edge_rule << " " << source;
+    if(!pch_file.empty())
+      out << " | " << pch_file;
+    out << '\n';
+    flags();
+    if(seed)
+      out << " reproflags = $reproflags -frandom-seed=" << object << '\n';
+    if(!pch_flag.empty())
+      out << " pch = " << pch_flag << '\n';
+    if(!compile_pool.empty())
+      out << " pool = " << compile_pool << '\n';
+  };
+  for(const auto& i: single)
+    build("$builddir/obj/" + name() + "/" + i + ".o", "$topdir/" + src + i + ext);
+  // A unity source includes a group of sources by their path relative
+  // to the unity source.  It's only rewritten when the group changes
+  // so regenerating build.ninja doesn't trigger a rebuild by itself.
+  // The unity sources are shared by all variants.
+  auto dir = fs::absolute(fs::path(project.builddir()) / "unity" / name()).lexically_normal();
+  auto top = fs::absolute(fs::path(project.topdir()) / src);
+  for(std::size_t i = 0; i != groups.size(); ++i)
+  {
+    auto file = name() + "/" + std::to_string(i) + ext;
+    std::ostringstream content;
+    content << "// Generated by m, do not edit.\n";
+    for(const auto& s: groups[i])
+      content << "#include \"" << (top / (s + ext)).lexically_normal().lexically_relative(dir).generic_string() << "\"\n";
+    write_if_changed((fs::path(project.builddir()) / "unity" / file).string(), content.str());
+    project.generated("$unitydir/" + file);
+    build("$builddir/obj/" + name() + "/unity/" + std::to_string(i) + ".o", "$unitydir/" + file);
+  }
+}
+
+Toolchain::Compiler Toolchain::compiler() const
+{
+  if(_compiler == Compiler::UNKNOWN)
+  {
+    _compiler = Compiler::GCC;
+    auto cxx = bp::search_path("c++");
+    if(!cxx.empty())
+    {
+      std::future<std::string> version;
+      bp::system(cxx, "--version", bp::std_out > version, bp::std_err > bp::null);
+      if(version.get().find("clang") != std::string::npos)
+        _compiler = Compiler::CLANG;
+    }
+  }
+  return _compiler;
+}
+
+std::string Toolchain::fast_linker() const
+{
+  static const std::vector<std::pair<std::string, std::string>> linkers =
+  {
+    {"ld.mold", "mold"}, {"ld.lld", "lld"}, {"ld.gold", "gold"}
+  };
+  for(const auto& l: linkers)
+    if(!bp::search_path(l.first).empty())
+      return l.second;
+  return {};
+}
+
+std::string Toolchain::ar(bool lto) const
+{
+  if(!lto)
+    return "ar";
+  if(!clang())
+    return "gcc-ar";
+  auto llvm_ar = bp::search_path("llvm-ar");
+  return llvm_ar.empty() ? "ar" : llvm_ar.string();
 }
 
 BuilderBase& BuilderBase::lib(const std::string& name)
 {
+  // This object may be _current so save the project before deleting it.
+  auto& project = _project;
+  delete _current;
+  _current = new LibraryBuilder(project, name);
+  return *_current;
+}
+
+Library::Type BuilderBase::library_type(const std::string& type)
+{
+  if(type == "static"s)
+    return Library::Type::STATIC;
+  if(type == "thin"s)
+  {
+#ifdef __APPLE__
+    // Apple's ar has no thin archives; its 'T' truncates member
+    // names instead.
+    throw std::runtime_error("type: 'thin' is not supported on macOS");
+#else
+    return Library::Type::THIN;
+#endif
+  }
+  if(type == "objects"s)
+    return Library::Type::OBJECTS;
+  if(type == "shared"s)
+    return Library::Type::SHARED;
+  throw std::runtime_error("type: unknown library type '" + type + "'");
+}
+
+const std::string& BuilderBase::library_visibility(const std::string& visibility)
+{
+  if(visibility != "default"s && visibility != "hidden"s)
+    throw std::runtime_error("visibility: unknown visibility '" + visibility + "'");
+  return visibility;
+}
+
+BuilderBase& BuilderBase::variant(const std::string& name)
+{
+  auto& project = _project;
   delete _current;
-  _current = new LibraryBuilder(_project, name);
+  _current = new VariantBuilder(project, name);
   return *_current;
 }
 
 BuilderBase& BuilderBase::frameworks(const std::string& name, const std::string& path)
 {
+  auto& project = _project;
   delete _current;
-  _current = new FrameworkBuilder(_project, name, path);
+  _current = new FrameworkBuilder(project, name, path);
   return *_current;
 }
 
 BuilderBase& BuilderBase::lib(const std::string& name, const std::string& pattern)
 {
+  auto& project = _project;
   delete _current;
-  _current = new TemplateBuilder(_project, name, pattern);
+  _current = new TemplateBuilder(project, name, pattern);
   return *_current;
 }
 
 BuilderBase& BuilderBase::bin(const std::string& name)
 {
+  auto& project = _project;
   delete _current;
-  _current = new BinaryBuilder(_project, name);
+  _current = new BinaryBuilder(project, name);
   return *_current;
 }
 
@@ -79,68 +707,1220 @@ ProjectBuilder& ProjectBuilder::create(const std::string& name, const std::strin
   return *new ProjectBuilder(name, top, build);
 }
 
+namespace {
+std::mutex output_mutex;
+
+// Fetches run concurrently so keep each message on a line of its own.
+void report(const std::string& message)
+{
+  std::lock_guard<std::mutex> lock(output_mutex);
+  std::cout << message << std::endl;
+}
+}
+
+// Runs git in the directory given to the constructor.  The process
+// wide current directory is left alone so that several fetches can
+// run at the same time.
 class Git
 {
   public:
-    Git() : _git(bp::search_path("git")) {}
-    int clone(const std::string& url, const fs::path& location)
+    Git(const fs::path& dir) : _dir(dir) {}
+    int clone(const std::string& url, const std::vector<std::string>& options = {})
+    {
+      std::vector<std::string> args{"clone", "-q"};
+      args.insert(args.end(), options.begin(), options.end());
+      args.push_back(url);
+      args.push_back(_dir.string());
+      return bp::system(git(), args);
+    }
+    // An empty repository with 'url' as its origin.
+    int init(const std::string& url)
+    {
+      auto ec = bp::system(git(), "init", "-q", _dir);
+      if(ec != 0)
+        return ec;
+      return bp::system(git(), "remote", "add", "origin", url, bp::start_dir = _dir.string());
+    }
+    int mirror(const std::string& url)
     {
-      return bp::system(_git, "clone", url, location);
+      return bp::system(git(), "clone", "-q", "--mirror", url, _dir);
+    }
+    bool contains(const std::string& ref)
+    {
+      return bp::system(git(), "cat-file", "-e", ref + "^{commit}", bp::std_out > bp::null,
+        bp::std_err > bp::null, bp::start_dir = _dir.string()) == 0;
+    }
+    int config(const std::string& key, const std::string& value)
+    {
+      return bp::system(git(), "config", key, value, bp::start_dir = _dir.string());
     }
     int summary(const std::string& ref)
     {
-      return bp::system(_git, "show", "--summary", ref, bp::std_out > bp::null);
+      return bp::system(git(), "show", "--summary", ref, bp::std_out > bp::null,
+        bp::std_err > bp::null, bp::start_dir = _dir.string());
     }
     int fetch(const std::string& from)
     {
-      return bp::system(_git, "fetch", from);
+      return bp::system(git(), "fetch", "-q", from, bp::start_dir = _dir.string());
+    }
+    // Fetch only 'ref' without any history.  'ref' is a full commit
+    // hash or a tag.  A tag is stored as a local tag so that the pin
+    // resolves without fetching again.
+    int fetch_shallow(const std::string& from, const std::string& ref)
+    {
+      bool hash = (ref.size() == 40 || ref.size() == 64)
+        && std::all_of(ref.begin(), ref.end(), [](unsigned char c) { return std::isxdigit(c); });
+      auto refspec = hash ? ref : "refs/tags/" + ref + ":refs/tags/" + ref;
+      return bp::system(git(), "fetch", "-q", "--depth", "1", from, refspec,
+        bp::start_dir = _dir.string());
+    }
+    // Limit the working tree to 'paths', or check out everything if
+    // 'paths' is empty.
+    int sparse_checkout(const std::vector<std::string>& paths)
+    {
+      if(paths.empty())
+      {
+        if(!fs::exists(_dir / ".git" / "info" / "sparse-checkout"))
+          return 0;
+        return bp::system(git(), "sparse-checkout", "disable", bp::start_dir = _dir.string());
+      }
+      std::vector<std::string> args{"sparse-checkout", "set", "--cone"};
+      args.insert(args.end(), paths.begin(), paths.end());
+      return bp::system(git(), args, bp::start_dir = _dir.string());
     }
     const std::string get_hash(const std::string& ref)
     {
       std::future<std::string> os;
-      bp::system(_git, "log", "--pretty=format:%H", "-1", ref, bp::std_out > os);
+      bp::system(git(), "log", "--pretty=format:%H", "-1", ref, bp::std_out > os,
+        bp::std_err > bp::null, bp::start_dir = _dir.string());
       return os.get();
     }
-    int reset_hard(const std::string& ref)
+    // Check out 'ref' with a detached HEAD, discarding any local
+    // changes.  Committing or resetting in the checkout then always
+    // rewrites .git/HEAD, which 'm' watches to fetch again.
+    int checkout_detached(const std::string& ref)
+    {
+      return bp::system(git(), "checkout", "-q", "--force", "--detach", ref,
+        bp::start_dir = _dir.string());
+    }
+  private:
+    static const fs::path& git()
+    {
+      static const fs::path git = bp::search_path("git");
+      if(git.empty())
+        throw std::runtime_error("Can't find program 'git'");
+      return git;
+    }
+    const fs::path _dir;
+};
+
+namespace {
+// Advisory lock on a file which is held until the object is
+// destroyed.  Several processes may hold a shared lock at the same
+// time.
+class FileLock
+{
+  public:
+    FileLock(const fs::path& file, bool shared = false)
+      : _fd(::open(file.c_str(), O_RDWR | O_CREAT, 0666))
+    {
+      if(_fd < 0)
+        throw std::runtime_error("Can't open lock file " + file.string());
+      while(::flock(_fd, shared ? LOCK_SH : LOCK_EX) != 0)
+        if(errno != EINTR)
+        {
+          ::close(_fd);
+          throw std::runtime_error("Can't lock " + file.string());
+        }
+    }
+    FileLock(const FileLock&) = delete;
+    ~FileLock()
+    {
+      ::flock(_fd, LOCK_UN);
+      ::close(_fd);
+    }
+  private:
+    int _fd;
+};
+
+// A bare mirror of a remote repository in the user's cache directory
+// ($XDG_CACHE_HOME/m/git or ~/.cache/m/git) shared by all checkouts.
+// External libraries are cloned with the mirror as a reference so
+// that only objects missing from the mirror are downloaded.
+class Mirror
+{
+  public:
+    Mirror(const std::string& url)
+    {
+      fs::path cache;
+      if(auto xdg = std::getenv("XDG_CACHE_HOME"))
+        cache = xdg;
+      else if(auto home = std::getenv("HOME"))
+        cache = fs::path(home) / ".cache";
+      if(cache.empty() || !cache.is_absolute())
+        return;
+      // FNV-1a hash of the url keeps the name unique and stable.
+      std::uint64_t hash = 14695981039346656037ull;
+      std::string name;
+      for(auto c: url)
+      {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+        name += std::isalnum(static_cast<unsigned char>(c)) ? c : '_';
+      }
+      if(name.size() > 64)
+        name.erase(0, name.size() - 64);
+      std::ostringstream os;
+      os << name << '-' << std::hex << hash;
+      _path = cache / "m" / "git" / os.str();
+    }
+    const fs::path& path() const { return _path; }
+    // Makes sure the mirror exists and contains 'ref'.  Returns false
+    // if the mirror can't be used.
+    bool update(const std::string& name, const std::string& url, const std::string& ref)
+    {
+      if(_path.empty())
+        return false;
+      boost::system::error_code ec;
+      fs::create_directories(_path.parent_path(), ec);
+      if(ec)
+        return false;
+      FileLock lock(lock_file());
+      Git git(_path);
+      if(!fs::exists(_path))
+      {
+        report(name + ": mirroring " + url);
+        if(git.mirror(url) != 0)
+        {
+          fs::remove_all(_path, ec);
+          return false;
+        }
+        // Checkouts refer to the objects in the mirror so they must
+        // never be garbage collected.
+        git.config("gc.auto", "0");
+        git.config("gc.pruneExpire", "never");
+      }
+      else if(!git.contains(ref))
+      {
+        report(name + ": updating mirror of " + url);
+        git.fetch("origin");
+      }
+      return true;
+    }
+    fs::path lock_file() const
+    {
+      auto lock = _path;
+      lock += ".lock";
+      return lock;
+    }
+  private:
+    fs::path _path;
+};
+}
+
+namespace {
+// Remembers the commit an external library was last checked out at
+// for a given pin.  As long as the pin is the same and HEAD still
+// points at that commit there is no need to run git at all.
+class Stamp
+{
+  public:
+    Stamp(const fs::path& location, const External& external)
+      : _git_dir(location / ".git")
     {
-      return bp::system(_git, "reset", "--hard", ref);
+      std::ostringstream os;
+      os << external.url() << '\t' << external.hash() << '\t' << static_cast<int>(external.mode());
+      for(const auto& path: external.sparse())
+        os << '\t' << path;
+      _pin = os.str();
+    }
+    bool current() const
+    {
+      std::ifstream in{(_git_dir / "m-stamp").string()};
+      std::string pin;
+      std::string hash;
+      if(!std::getline(in, pin) || !std::getline(in, hash) || pin != _pin)
+        return false;
+      return !hash.empty() && hash == head();
+    }
+    void save(const std::string& hash) const
+    {
+      std::ofstream out{(_git_dir / "m-stamp").string()};
+      out << _pin << '\n' << hash << '\n';
     }
   private:
-    fs::path _git;
+    // Resolve HEAD by reading the files in the .git directory.
+    // Returns an empty string if it can't be resolved that way.
+    std::string head() const
+    {
+      std::ifstream in{(_git_dir / "HEAD").string()};
+      std::string line;
+      if(!std::getline(in, line))
+        return "";
+      static const std::string prefix{"ref: "};
+      if(line.compare(0, prefix.size(), prefix) != 0)
+        return line;
+      auto ref = line.substr(prefix.size());
+      std::ifstream loose{(_git_dir / ref).string()};
+      std::string hash;
+      if(std::getline(loose, hash))
+        return hash;
+      std::ifstream packed{(_git_dir / "packed-refs").string()};
+      while(std::getline(packed, line))
+      {
+        auto space = line.find(' ');
+        if(space != std::string::npos && line.compare(space + 1, std::string::npos, ref) == 0)
+          return line.substr(0, space);
+      }
+      return "";
+    }
+    const fs::path _git_dir;
+    std::string _pin;
 };
+}
 
-void Project::fetch(const std::string& name, const std::string& url, const std::string& hash_or_tag) const
+void Project::fetch(const std::string& name, const External& external) const
 {
+  const auto& url = external.url();
+  const auto& hash_or_tag = external.hash();
+  const auto mode = external.mode();
   fs::path location = _topdir;
   location /= ".externals";
   location /= name;
-  Git git;
+  Stamp stamp(location, external);
+  if(stamp.current())
+    return;
+  Git git(location);
+  // The mirror has the complete history so it's only used for full
+  // clones.
+  Mirror mirror(url);
+  bool full = mode == External::Mode::FULL;
+  // Set when the working tree is still empty.
+  bool checkout = false;
   if(!fs::exists(location))
   {
-    std::cout << "Cloning " << url << std::endl;
-    git.clone(url, location);
+    report(name + ": cloning " + url);
+    std::vector<std::string> options;
+    if(!external.sparse().empty() || mode == External::Mode::PARTIAL)
+    {
+      options.push_back("--no-checkout");
+      checkout = true;
+    }
+    int ec;
+    if(mode == External::Mode::SHALLOW)
+    {
+      ec = git.init(url);
+      checkout = true;
+    }
+    else if(mode == External::Mode::PARTIAL)
+    {
+      options.push_back("--filter=blob:none");
+      ec = git.clone(url, options);
+    }
+    else if(mirror.update(name, url, hash_or_tag))
+    {
+      FileLock lock(mirror.lock_file(), true);
+      options.push_back("--reference");
+      options.push_back(mirror.path().string());
+      ec = git.clone(url, options);
+    }
+    else
+      ec = git.clone(url, options);
+    if(ec != 0)
+      throw std::runtime_error(name + ": can't clone " + url);
   }
-  auto current_path = fs::current_path();
-  fs::current_path(location);
+  if(git.sparse_checkout(external.sparse()) != 0)
+    throw std::runtime_error(name + ": can't set up sparse checkout");
   auto ec = git.summary(hash_or_tag);
   if(ec != 0)
   {
-    std::cout << "Fetching " << location << std::endl;
-    git.fetch("origin");
+    report(name + ": fetching " + location.string());
+    if(mode == External::Mode::SHALLOW)
+    {
+      // Branches and abbreviated hashes can't be fetched by name
+      // without fetching the refs they're resolved against.
+      ec = git.fetch_shallow("origin", hash_or_tag);
+      if(ec != 0)
+        throw std::runtime_error(name + ": can't fetch " + hash_or_tag + " from " + url
+          + ", 'shallow' needs a full commit hash or a tag");
+    }
+    else
+    {
+      if(full)
+        mirror.update(name, url, hash_or_tag);
+      ec = git.fetch("origin");
+    }
+    if(ec != 0)
+      throw std::runtime_error(name + ": can't fetch from " + url);
   }
   auto head = git.get_hash("HEAD");
   auto hash = git.get_hash(hash_or_tag);
+  if(hash.empty())
+    throw std::runtime_error(name + ": can't find " + hash_or_tag);
+  if(head != hash || checkout)
+  {
+    report(name + ": checking out " + hash_or_tag + " in " + location.string());
+    if(git.checkout_detached(hash_or_tag) != 0)
+      throw std::runtime_error(name + ": can't check out " + hash_or_tag);
+    head = git.get_hash("HEAD");
+  }
   if(head != hash)
+    throw std::runtime_error(name + ": checked out " + head + " instead of " + hash_or_tag);
+  stamp.save(hash);
+}
+
+namespace {
+// The most recent peak memory use in kilobytes of each output built
+// through 'm --rss'.  Older entries for the same output are dropped
+// from the file.
+std::map<std::string, long> rss_history(const std::string& builddir)
+{
+  std::map<std::string, long> result;
+  auto file = fs::path(builddir) / ".m" / "rss";
+  std::ifstream in{file.string()};
+  std::string line;
+  std::size_t lines = 0;
+  while(std::getline(in, line))
   {
-    std::cout << "Reset " << location << std::endl;
-    git.reset_hard(hash_or_tag);
+    std::istringstream is{line};
+    long kb = 0;
+    std::string output;
+    if(is >> kb && std::getline(is >> std::ws, output))
+      result[output] = kb;
+    ++lines;
   }
-  fs::current_path(current_path);
+  if(lines > result.size())
+  {
+    std::ostringstream out;
+    for(const auto& i: result)
+      out << i.second << ' ' << i.first << '\n';
+    write_if_changed(file.string(), out.str());
+  }
+  return result;
+}
+}
+
+bool Project::has_pool(const std::string& name) const
+{
+  if(name == "console"s || name == compile_pool() || name == link_pool())
+    return true;
+  for(const auto& p: _pools)
+    if(p.first == name)
+      return true;
+  return false;
+}
+
+const std::string& Project::compile_pool() const
+{
+  static const std::string none;
+  static const std::string pool{"compile_pool"};
+  return _compile_jobs != 0 ? pool : none;
+}
+
+const std::string& Project::link_pool() const
+{
+  static const std::string none;
+  static const std::string pool{"link_pool"};
+  return _link_jobs != 0 ? pool : none;
+}
+
+namespace {
+const std::string pools_file{".m/pools.ninja"};
+
+// The memory available for new processes in kilobytes.  Unlike the
+// free memory, MemAvailable includes the page cache which the kernel
+// can reclaim.
+long available_memory()
+{
+  std::ifstream in{"/proc/meminfo"};
+  std::string key;
+  long kb = 0;
+  while(in >> key >> kb)
+  {
+    if(key == "MemAvailable:"s)
+      return kb;
+    in.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+  }
+#ifdef _SC_AVPHYS_PAGES
+  return sysconf(_SC_AVPHYS_PAGES) / 1024 * sysconf(_SC_PAGESIZE);
+#else
+  return sysconf(_SC_PHYS_PAGES) / 1024 * sysconf(_SC_PAGESIZE);
+#endif
+}
+
+// In the automatic mode the depth of a pool is how many of the
+// largest jobs seen so far fit in 90% of the available memory.  A
+// depth of 0 means no limit, which is used until a build has been
+// run with the pool in place.
+void write_pools(const std::string& builddir, bool compile_auto, bool link_auto)
+{
+  long compile = 0;
+  long link = 0;
+  for(const auto& i: rss_history(builddir))
+  {
+    // Binaries are linked into $builddir/bin or the bin directory of
+    // a variant.
+    auto dir = fs::path(i.first).parent_path();
+    if((dir.filename() == "bin" && dir.parent_path().filename() != "obj")
+      || fs::path(i.first).extension() == shared_extension)
+      link = std::max(link, i.second);
+    else
+      compile = std::max(compile, i.second);
+  }
+  long memory = available_memory();
+  auto depth = [memory](long peak) {
+    return peak > 0 ? std::max(1L, memory / 10 * 9 / peak) : 0L;
+  };
+  std::ostringstream out;
+  out << preamble[0] << '\n';
+  if(compile_auto)
+    out << "\npool compile_pool\n depth = " << depth(compile) << '\n';
+  if(link_auto)
+    out << "\npool link_pool\n depth = " << depth(link) << '\n';
+  write_if_changed((fs::path(builddir) / pools_file).string(), out.str());
+}
+}
+
+void update_pools(const std::string& builddir)
+{
+  std::ifstream in{(fs::path(builddir) / pools_file).string()};
+  if(!in)
+    return;
+  bool compile_auto = false;
+  bool link_auto = false;
+  std::string line;
+  while(std::getline(in, line))
+  {
+    compile_auto = compile_auto || line == "pool compile_pool"s;
+    link_auto = link_auto || line == "pool link_pool"s;
+  }
+  in.close();
+  if(compile_auto || link_auto)
+    write_pools(builddir, compile_auto, link_auto);
+}
+
+// Pools sized automatically are written to a file of their own which
+// is updated on every run of 'm', so that the depth follows the
+// recorded memory use without generating build.ninja again.
+void Project::generate_pools(std::ostream& out) const
+{
+  if(_compile_jobs > 0)
+    out << "\npool " << compile_pool() << "\n depth = " << _compile_jobs << '\n';
+  if(_link_jobs > 0)
+    out << "\npool " << link_pool() << "\n depth = " << _link_jobs << '\n';
+  for(const auto& p: _pools)
+    out << "\npool " << p.first << "\n depth = " << p.second << '\n';
+  if(_compile_jobs < 0 || _link_jobs < 0)
+  {
+    write_pools(_builddir, _compile_jobs < 0, _link_jobs < 0);
+    generated("$builddir/" + pools_file);
+    out << "\ninclude $builddir/" << pools_file << '\n';
+  }
+}
+
+// GCC has no equivalent of ThinLTO so 'thin' uses GCC's parallel
+// link time optimization.  Clang keeps a ThinLTO cache in
+// $builddir/lto-cache so relinking only optimizes modules which
+// have changed.
+void Project::generate_lto(std::ostream& out) const
+{
+  out << "ar = " << _toolchain.ar(_lto != Lto::NONE) << '\n';
+#ifdef __APPLE__
+  out << "arflags = cr\n";
+#else
+  // Deterministic archives have no timestamps, owners or modes.
+  out << "arflags = " << (_reproducible ? "crD" : "cr") << '\n';
+#endif
+  if(_lto == Lto::NONE)
+    return;
+  if(!_toolchain.clang())
+  {
+    out << "ltoflags = -flto\n";
+    out << "ltoldflags = -flto=auto -fuse-linker-plugin\n";
+    return;
+  }
+  if(_lto == Lto::FULL)
+  {
+    out << "ltoflags = -flto\n";
+#ifdef __APPLE__
+    out << "ltoldflags = -flto\n";
+#else
+    out << "ltoldflags = -flto -fuse-ld=lld\n";
+#endif
+    return;
+  }
+  out << "ltoflags = -flto=thin\n";
+#ifdef __APPLE__
+  out << "ltoldflags = -flto=thin -Wl,-cache_path_lto,$builddir/lto-cache\n";
+#else
+  out << "ltoldflags = -flto=thin -fuse-ld=lld -Wl,--thinlto-cache-dir=$builddir/lto-cache\n";
+#endif
+}
+
+// Maps the absolute top directory and the directory ninja runs in to
+// relative paths in __FILE__ and the debug information, so objects
+// don't depend on where the tree is checked out.  External libraries
+// are under the top directory.
+void Project::generate_reproducible(std::ostream& out) const
+{
+  auto cwd = fs::current_path();
+  auto top = fs::path(_topdir).is_absolute() ? fs::path(_topdir) : fs::canonical(_topdir);
+  out << "reproflags =";
+  if(top != cwd)
+    out << " -ffile-prefix-map=" << top.string() << "=" << fs::relative(top, cwd).string();
+  out << " -ffile-prefix-map=" << cwd.string() << "=.\n";
+}
+
+Variant& Project::variant(const std::string& name)
+{
+  for(auto& v: _variants)
+    if(v.name() == name)
+      return v;
+  _variants.emplace_back(name);
+  return _variants.back();
+}
+
+// Each variant is a subninja with the same edges as the default
+// build.  It rebinds $builddir and the variant flags, and '$variant'
+// gives each target a phony alias such as 'hello_world@release'.
+// Without a 'default' statement ninja would build every variant.
+void Project::generate_variants(std::ostream& out, const std::string& targets) const
+{
+  if(_variants.empty())
+    return;
+  std::vector<std::string> defaults;
+  for(const auto& l: _libraries)
+    if(l->compiled())
+      defaults.push_back(l->file(*this));
+  for(const auto& b: _binaries)
+    defaults.push_back(b->name());
+  out << '\n';
+  for(const auto& v: _variants)
+  {
+    std::ostringstream content;
+    content << preamble[0] << "\n\n";
+    v.generate(content);
+    content << targets;
+    auto file = v.name() + ".ninja";
+    write_if_changed((fs::path(_builddir) / file).string(), content.str());
+    generated("$builddir/" + file);
+    out << "subninja $builddir/" << file << '\n';
+    out << "build @" << v.name() << ": phony";
+    for(const auto& d: defaults)
+      out << " " << d << "@" << v.name();
+    out << '\n';
+  }
+  print(defaults, out, "default", [&out](const auto& s) { out << " " << s; });
+}
+
+namespace {
+const std::string fragments_magic{"m-fragments 1"};
+
+// The subninja of an '_m' file relative to the build directory.
+std::string fragment_file(const std::string& input)
+{
+  std::string result = ".m/ninja";
+  for(const auto& p: fs::path(input.empty() ? "_m" : input).lexically_normal())
+  {
+    auto s = p.string();
+    if(s.empty() || s == "."s || s == "/"s)
+      continue;
+    result += "/" + (s == ".."s ? "__"s : s);
+  }
+  return result + ".ninja";
+}
+}
+
+// A fragment is only generated again when its digest changes.  The
+// digest covers the project settings, the version of 'm', the objects
+// defined in the '_m' file and the libraries they depend on wherever
+// those are defined, so changing a library invalidates the fragments
+// using it.  The digests and the files written along with each
+// fragment, i.e. unity sources, are kept in $builddir/.m/fragments.
+void Project::generate_fragments(std::ostream& out, const Digest& project) const
+{
+  struct Fragment
+  {
+    Symbol input;
+    std::vector<const Object*> objects;
+    std::vector<std::string> generated;
+  };
+  std::vector<Fragment> fragments;
+  std::unordered_map<Symbol, std::size_t> index;
+  auto add = [&](const Object* o) {
+    auto i = index.emplace(o->input(), fragments.size());
+    if(i.second)
+      fragments.push_back({o->input(), {}, {}});
+    fragments[i.first->second].objects.push_back(o);
+  };
+  for(const auto& l: _libraries)
+    add(l);
+  for(const auto& b: _binaries)
+    add(b);
+
+  auto cache_file = fs::path(_builddir) / ".m" / "fragments";
+  std::map<std::string, std::pair<std::uint64_t, std::vector<std::string>>> cache;
+  {
+    std::ifstream in{cache_file.string()};
+    std::string line;
+    std::vector<std::string>* generated = nullptr;
+    if(std::getline(in, line) && line == fragments_magic)
+      while(std::getline(in, line))
+      {
+        std::istringstream is{line};
+        std::string key;
+        is >> key;
+        if(key == "fragment"s)
+        {
+          std::uint64_t digest = 0;
+          std::string input;
+          is >> std::hex >> digest;
+          std::getline(is >> std::ws, input);
+          auto& c = cache[input];
+          c.first = digest;
+          generated = &c.second;
+        }
+        else if(key == "generated"s && generated)
+          generated->push_back(line.substr(key.size() + 1));
+      }
+  }
+  auto exists = [this](const std::string& file) {
+    static const std::string unitydir{"$unitydir/"};
+    static const std::string builddir{"$builddir/"};
+    if(file.compare(0, unitydir.size(), unitydir) == 0)
+      return fs::exists(fs::path(_builddir) / "unity" / file.substr(unitydir.size()));
+    if(file.compare(0, builddir.size(), builddir) == 0)
+      return fs::exists(fs::path(_builddir) / file.substr(builddir.size()));
+    return fs::exists(file);
+  };
+
+  // Generated fragments are only valid for the version of 'm' which
+  // wrote them.
+  auto version = project;
+  if(!_program.empty())
+  {
+    boost::system::error_code ec;
+    version << static_cast<std::uint64_t>(fs::last_write_time(_program, ec))
+      << static_cast<std::uint64_t>(fs::file_size(_program, ec));
+  }
+  std::unordered_map<const Object*, std::uint64_t> digests;
+  auto digest_of = [&](const Object& o) {
+    auto i = digests.find(&o);
+    if(i != digests.end())
+      return i->second;
+    Digest digest;
+    o.digest(digest, *this);
+    return digests[&o] = digest.value();
+  };
+
+  std::ostringstream saved;
+  saved << fragments_magic << '\n';
+  for(auto& f: fragments)
+  {
+    auto digest = version;
+    digest << f.input;
+    for(const auto& o: f.objects)
+    {
+      digest << digest_of(*o);
+      for(const auto& l: o->dependencies())
+        digest << digest_of(*l);
+    }
+    auto file = fragment_file(f.input);
+    auto c = cache.find(f.input);
+    if(c != cache.end() && c->second.first == digest.value()
+      && fs::exists(fs::path(_builddir) / file)
+      && std::all_of(c->second.second.begin(), c->second.second.end(), exists))
+      f.generated = c->second.second;
+    else
+    {
+      auto mark = _generated.size();
+      std::ostringstream content;
+      content << preamble[0] << '\n';
+      for(const auto& o: f.objects)
+        o->generate(content, *this);
+      write_if_changed((fs::path(_builddir) / file).string(), content.str());
+      f.generated.assign(_generated.begin() + mark, _generated.end());
+      _generated.resize(mark);
+    }
+    saved << "fragment " << std::hex << digest.value() << std::dec << ' ' << f.input << '\n';
+    for(const auto& g: f.generated)
+    {
+      saved << "generated " << g << '\n';
+      generated(g);
+    }
+    generated("$builddir/" + file);
+    // A variant redefines $builddir so the path is given as is.
+    out << "subninja " << (fs::path(_builddir) / file).generic_string() << '\n';
+  }
+  write_if_changed(cache_file.string(), saved.str());
+}
+
+// The fast link profile moves most debug information out of the
+// objects into .dwo files which the linker doesn't have to copy, and
+// uses a faster linker which also builds the gdb index so that gdb
+// doesn't have to on every start.  The compile flags come after the
+// user's flags since the .dwo files are outputs of the compile edges
+// and must always be written.
+void Project::generate_link_profile(std::ostream& out) const
+{
+  if(_link_profile != LinkProfile::FAST)
+    return;
+  out << "debugflags = -g -gsplit-dwarf -gz\n";
+  out << "linkerflags =";
+  auto linker = _toolchain.fast_linker();
+  if(!linker.empty())
+    out << " -fuse-ld=" << linker << " -Wl,--gdb-index";
+  out << " -Wl,--compress-debug-sections=zlib\n";
+}
+
+namespace {
+// Quotes 's' for the shell if it contains anything but letters,
+// digits and a few punctuation characters common in paths.
+std::string shell_quote(const std::string& s)
+{
+  if(!s.empty() && std::all_of(s.begin(), s.end(), [](unsigned char c) {
+      return std::isalnum(c) || std::strchr("/._-+,:=@%", c) != nullptr;
+    }))
+    return s;
+  std::string result{"'"};
+  for(auto c: s)
+    if(c == '\'')
+      result += "'\\''";
+    else
+      result += c;
+  return result + "'";
+}
+}
+
+std::string Project::launcher_program() const
+{
+  if(_launcher == "auto"s)
+  {
+    // Looked up once since it's needed for every precompiled header.
+    static const std::string found = []() {
+      for(const auto& name: {"ccache", "sccache"})
+      {
+        auto program = bp::search_path(name);
+        if(!program.empty())
+          return program.string();
+      }
+      return std::string();
+    }();
+    return found;
+  }
+  if(_launcher != "none"s)
+    return _launcher;
+  return {};
+}
+
+std::string Project::launcher() const
+{
+  fs::path program = launcher_program();
+  if(program.empty())
+    return {};
+  // Compiler caches are configured through the environment.  The
+  // base directory makes ccache rewrite absolute paths below the top
+  // directory so that different checkouts share cache entries.
+  std::string env;
+  auto name = program.filename().string();
+  if(name == "ccache"s)
+  {
+    if(!_cache_dir.empty())
+      env += " CCACHE_DIR=" + shell_quote(fs::weakly_canonical(fs::absolute(_cache_dir, _topdir)).string());
+    env += " CCACHE_BASEDIR=" + shell_quote(fs::weakly_canonical(_topdir).string());
+    bool pch = !_pch.empty();
+    for(const auto& l: _libraries)
+      pch = pch || !l->pch(*this).empty();
+    for(const auto& b: _binaries)
+      pch = pch || !b->pch(*this).empty();
+    if(pch)
+      env += " CCACHE_SLOPPINESS=pch_defines,time_macros";
+  }
+  else if(name == "sccache"s)
+  {
+    if(!_cache_dir.empty())
+      env += " SCCACHE_DIR=" + shell_quote(fs::weakly_canonical(fs::absolute(_cache_dir, _topdir)).string());
+  }
+  if(env.empty())
+    return shell_quote(program.string());
+  return "env" + env + " " + shell_quote(program.string());
+}
+
+std::vector<std::string> Project::externals() const
+{
+  std::vector<std::string> result;
+  for(const auto& l: _libraries)
+    if(l->external())
+    {
+      auto location = fs::path(_topdir) / ".externals" / l->name();
+      result.push_back(location.string());
+      auto git_dir = location / ".git";
+      result.push_back((git_dir / "HEAD").string());
+      result.push_back((git_dir / "m-stamp").string());
+      // A checkout made by an older 'm' may still be on a branch,
+      // which moves without HEAD changing.  Watch the same files
+      // Stamp reads to resolve it.
+      std::ifstream head{(git_dir / "HEAD").string()};
+      std::string line;
+      static const std::string prefix{"ref: "};
+      if(std::getline(head, line) && line.compare(0, prefix.size(), prefix) == 0)
+      {
+        result.push_back((git_dir / line.substr(prefix.size())).string());
+        result.push_back((git_dir / "packed-refs").string());
+      }
+    }
+  return result;
+}
+
+void Project::fetch(unsigned jobs) const
+{
+  std::vector<const Library*> externals;
+  for(const auto& l: _libraries)
+    if(l->external())
+      externals.push_back(l);
+  if(externals.empty())
+    return;
+  jobs = std::max(1u, std::min<unsigned>(jobs, externals.size()));
+  std::atomic<std::size_t> next{0};
+  std::atomic<std::size_t> done{0};
+  std::vector<std::string> errors;
+  auto worker = [&]() {
+    for(auto i = next++; i < externals.size(); i = next++)
+    {
+      const auto& l = *externals[i];
+      try
+      {
+        fetch(l.name(), *l.external());
+        report("["s + std::to_string(++done) + "/" + std::to_string(externals.size()) + "] "
+          + l.name());
+      }
+      catch(const std::exception& e)
+      {
+        std::lock_guard<std::mutex> lock(output_mutex);
+        errors.push_back(e.what());
+      }
+    }
+  };
+  std::vector<std::thread> threads;
+  for(unsigned i = 1; i < jobs; ++i)
+    threads.emplace_back(worker);
+  worker();
+  for(auto& t: threads)
+    t.join();
+  if(!errors.empty())
+  {
+    std::string message{"Failed to fetch external libraries:"};
+    for(const auto& e: errors)
+      message += "\n  "s + e;
+    throw std::runtime_error(message);
+  }
+}
+}
+
+namespace {
+// The absolute path of this program, used by ninja to regenerate
+// build.ninja.
+fs::path self(const char* argv0)
+{
+  fs::path program{argv0};
+  if(program.has_parent_path())
+    return fs::absolute(program);
+  return bp::search_path(argv0);
+}
+
+// Prints the time since 'start' and the peak memory use so far, for
+// measuring 'm' itself with --timings.
+void timing(const std::string& phase, std::chrono::steady_clock::time_point start)
+{
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  long kb = usage.ru_maxrss / 1024;
+#else
+  long kb = usage.ru_maxrss;
+#endif
+  std::cerr << phase << ": " << std::fixed << std::setprecision(3) << elapsed.count()
+    << "s, peak RSS " << kb / 1024 << " MB\n";
+}
+
+// External libraries are fetched using the same number of parallel
+// jobs as ninja is asked to use with '-j'.
+unsigned jobs(const std::vector<std::string>& args)
+{
+  for(std::size_t i = 0; i != args.size(); ++i)
+  {
+    std::string value;
+    if(args[i] == "-j"s && i + 1 != args.size())
+      value = args[i + 1];
+    else if(args[i].compare(0, 2, "-j"s) == 0)
+      value = args[i].substr(2);
+    else
+      continue;
+    try
+    {
+      auto n = std::stoi(value);
+      if(n > 0)
+        return n;
+    }
+    catch(const std::logic_error&)
+    {
+    }
+  }
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Runs a compile or link command for ninja and appends its peak
+// memory use and output file to $builddir/.m/rss.
+int rss(const std::string& builddir, const char** command)
+{
+  pid_t pid = fork();
+  if(pid < 0)
+  {
+    std::perror("fork");
+    return 1;
+  }
+  if(pid == 0)
+  {
+    execvp(command[0], const_cast<char* const*>(command));
+    std::perror(command[0]);
+    _exit(127);
+  }
+  int status = 0;
+  struct rusage usage;
+  while(wait4(pid, &status, 0, &usage) < 0)
+    if(errno != EINTR)
+    {
+      std::perror("wait4");
+      return 1;
+    }
+  std::string output;
+  for(auto p = command; *p; ++p)
+    if(p[0] == "-o"s && p[1])
+      output = p[1];
+  if(!output.empty())
+  {
+#ifdef __APPLE__
+    long kb = usage.ru_maxrss / 1024;
+#else
+    long kb = usage.ru_maxrss;
+#endif
+    auto line = std::to_string(kb) + " " + output + "\n";
+    auto file = fs::path(builddir) / ".m" / "rss";
+    int fd = open(file.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0666);
+    if(fd >= 0)
+    {
+      if(write(fd, line.data(), line.size()) < 0)
+        std::perror(file.c_str());
+      close(fd);
+    }
+  }
+  if(WIFSIGNALED(status))
+    return 128 + WTERMSIG(status);
+  return WEXITSTATUS(status);
+}
+
+// Hit and miss counts reported by the compiler cache.
+struct CacheStats
+{
+  long hits = 0;
+  long misses = 0;
+};
+
+// The value of a top level variable in build.ninja.  The variables
+// all come before the first build edge.
+std::string ninja_variable(const std::string& name)
+{
+  std::ifstream in{"build.ninja"};
+  std::string line;
+  auto prefix = name + " = ";
+  while(std::getline(in, line))
+  {
+    if(line.compare(0, prefix.size(), prefix) == 0)
+      return line.substr(prefix.size());
+    if(line.compare(0, 6, "build ") == 0)
+      break;
+  }
+  return {};
+}
+
+// Parses a count following 'label' on a line, if it's only a count.
+bool count(const std::string& line, const std::string& label, long& result)
+{
+  if(line.compare(0, label.size(), label) != 0)
+    return false;
+  auto value = line.substr(label.size());
+  value.erase(0, value.find_first_not_of(" \t"));
+  std::size_t end = 0;
+  try
+  {
+    result = std::stol(value, &end);
+  }
+  catch(const std::logic_error&)
+  {
+    return false;
+  }
+  return end == value.size();
+}
+
+// The name of the program run by the launcher, which is the last word
+// and may be quoted.
+std::string launcher_tool(const std::string& launcher)
+{
+  auto tool = launcher.substr(launcher.find_last_of("/ ") + 1);
+  tool.erase(std::remove(tool.begin(), tool.end(), '\''), tool.end());
+  return tool;
+}
+
+// Reads the statistics of ccache or sccache using the same launcher
+// command, and so the same cache directory, as the compile rules.
+CacheStats cache_stats(const std::string& launcher)
+{
+  auto tool = launcher_tool(launcher);
+  std::string option;
+  if(tool == "ccache"s)
+    option = " --print-stats";
+  else if(tool == "sccache"s)
+    option = " --show-stats";
+  else
+    throw std::runtime_error("--stats: not supported for " + tool);
+  std::future<std::string> output;
+  auto status = bp::system("/bin/sh", "-c", launcher + option, bp::std_out > output,
+    bp::std_err > bp::null);
+  auto text = output.get();
+  if(status != 0)
+    throw std::runtime_error("--stats: can't get statistics from " + tool);
+  CacheStats stats;
+  std::istringstream is{text};
+  std::string line;
+  long n = 0;
+  while(std::getline(is, line))
+  {
+    if(count(line, "direct_cache_hit\t", n) || count(line, "preprocessed_cache_hit\t", n)
+      || count(line, "Cache hits ", n))
+      stats.hits += n;
+    else if(count(line, "cache_miss\t", n) || count(line, "Cache misses ", n))
+      stats.misses += n;
+  }
+  return stats;
+}
+
+void report_stats(const std::string& launcher, const CacheStats& before, const CacheStats& after)
+{
+  auto tool = launcher_tool(launcher);
+  auto hits = after.hits - before.hits;
+  auto misses = after.misses - before.misses;
+  std::cout << tool << ": " << hits << " hits, " << misses << " misses";
+  if(hits + misses > 0)
+    std::cout << " (" << hits * 100 / (hits + misses) << "% hit rate)";
+  std::cout << '\n';
+}
+
+// Copies the source tree for a test build, leaving out the build
+// directory and version control.
+void copy_tree(const fs::path& from, const fs::path& to, const fs::path& skip)
+{
+  fs::create_directories(to);
+  for(fs::directory_iterator d(from), end; d != end; ++d)
+  {
+    auto name = d->path().filename().string();
+    if(name == ".git"s || name == ".hg"s || name == ".svn"s)
+      continue;
+    auto target = to / d->path().filename();
+    if(fs::is_symlink(d->symlink_status()))
+      fs::copy_symlink(d->path(), target);
+    else if(fs::is_directory(d->status()))
+    {
+      if(skip.empty() || !fs::equivalent(d->path(), skip))
+        copy_tree(d->path(), target, skip);
+    }
+    else if(fs::is_regular_file(d->status()))
+      fs::copy_file(d->path(), target);
+  }
+}
+
+// The outputs of a build relative to the build directory.  Logs,
+// depfiles and the state of 'm' itself are left out.
+std::set<std::string> outputs(const fs::path& builddir)
+{
+  std::set<std::string> result;
+  for(fs::recursive_directory_iterator d(builddir), end; d != end; ++d)
+  {
+    auto name = d->path().filename().string();
+    if(fs::is_directory(d->status()))
+    {
+      if(name == ".m"s)
+        d.no_push();
+      continue;
+    }
+    if(name.compare(0, 6, ".ninja"s) == 0 || d->path().extension() == ".d"s)
+      continue;
+    result.insert(d->path().lexically_relative(builddir).generic_string());
+  }
+  return result;
+}
+
+bool same_content(const fs::path& a, const fs::path& b)
+{
+  if(fs::file_size(a) != fs::file_size(b))
+    return false;
+  std::ifstream in_a{a.string(), std::ios::binary};
+  std::ifstream in_b{b.string(), std::ios::binary};
+  return std::equal(std::istreambuf_iterator<char>(in_a), std::istreambuf_iterator<char>(),
+    std::istreambuf_iterator<char>(in_b));
+}
+
+// Builds copies of the tree in two directories with different paths
+// and compares the outputs.  Compiler caches are turned off so the
+// second build doesn't just reuse the objects of the first.
+int verify_reproducible(const std::string& program, const std::string& topdir,
+  const std::string& builddir, const std::vector<std::string>& args)
+{
+  auto root = fs::temp_directory_path() / fs::unique_path("m-reproducible-%%%%%%");
+  std::vector<fs::path> trees{root / "a" / "src", root / "second" / "source"};
+  auto env = boost::this_process::environment();
+  env["CCACHE_DISABLE"] = "1";
+  env["SCCACHE_DISABLE"] = "1";
+  boost::system::error_code ec;
+  auto skip = fs::exists(builddir) ? fs::path(builddir) : fs::path();
+  for(const auto& tree: trees)
+  {
+    copy_tree(topdir, tree, skip);
+    std::cout << "Building in " << tree.string() << std::endl;
+    if(bp::system(program, args, bp::start_dir(tree.string()), env) != 0)
+      throw std::runtime_error("--verify-reproducible: build failed in " + tree.string()
+        + ", the builds are kept in " + root.string());
+  }
+  auto first = outputs(trees[0] / "build");
+  auto second = outputs(trees[1] / "build");
+  std::vector<std::string> differ;
+  for(const auto& file: first)
+    if(!second.count(file)
+      || !same_content(trees[0] / "build" / file, trees[1] / "build" / file))
+      differ.push_back(file);
+  for(const auto& file: second)
+    if(!first.count(file))
+      differ.push_back(file);
+  if(differ.empty())
+  {
+    std::cout << first.size() << " outputs are identical\n";
+    fs::remove_all(root, ec);
+    return 0;
+  }
+  std::cout << differ.size() << " of " << first.size() << " outputs differ:\n";
+  for(const auto& file: differ)
+    std::cout << "  " << file << '\n';
+  std::cout << "The builds are kept in " << root.string() << '\n';
+  return 1;
 }
 }
 
 int main(int argc, const char** argv)
 {
+  // Used by the compile and link rules when pools are sized
+  // automatically.  The top directory may come first.
+  for(int i = 1; i != 3 && i + 2 < argc; ++i)
+    if(argv[i] == "--rss"s && argv[i + 2] == "--"s)
+      return rss(argv[i + 1], argv + i + 3);
   std::string topdir{"."};
   std::string builddir{"build"};
   std::string _m{"_m"};
@@ -157,23 +1937,122 @@ int main(int argc, const char** argv)
       ++start;
     }
   }
-  const std::vector<std::string> args{argv + start, argv + argc};
+  std::vector<std::string> args{argv + start, argv + argc};
+  // Used by ninja to only regenerate build.ninja.  ninja runs it when
+  // any input is newer than build.ninja, including directories with
+  // only unrelated changes, so the state is still checked.
+  auto regenerate = std::find(args.begin(), args.end(), "--regenerate"s);
+  bool generate_only = regenerate != args.end();
+  if(generate_only)
+    args.erase(regenerate);
+  // Report the compiler cache hit rate of the ninja run.
+  auto stats = std::find(args.begin(), args.end(), "--stats"s);
+  bool show_stats = stats != args.end();
+  if(show_stats)
+    args.erase(stats);
+  // Reports on the last build instead of building.
+  bool profile = std::find(args.begin(), args.end(), "--profile"s) != args.end();
+  bool time_report = std::find(args.begin(), args.end(), "--time-report"s) != args.end();
+  bool deps = std::find(args.begin(), args.end(), "--deps"s) != args.end();
+  bool json = std::find(args.begin(), args.end(), "--json"s) != args.end();
+  // Builds the project twice in different places and compares.
+  auto verify = std::find(args.begin(), args.end(), "--verify-reproducible"s);
+  bool verify_only = verify != args.end();
+  if(verify_only)
+    args.erase(verify);
+  // Prints how long loading the '_m' files and generating build.ninja
+  // took.
+  auto timings = std::find(args.begin(), args.end(), "--timings"s);
+  bool show_timings = timings != args.end();
+  if(show_timings)
+    args.erase(timings);
   try
   {
-    m::Loader loader(topdir, builddir);
-    m::Project p = loader.load_file(_m);
-    std::ofstream out{"build.ninja"};
-    if(!out)
-      throw std::runtime_error("Can't open build.ninja for writing");
-    p.generate(out);
+    auto program = self(argv[0]).string();
+    if(profile || time_report || deps)
+    {
+      m::Loader loader(topdir, builddir);
+      m::Project p = loader.load_file(_m);
+      auto print = [json](const auto& report) {
+        if(json)
+          report.json(std::cout);
+        else
+          report.print(std::cout);
+      };
+      auto log = (fs::path(builddir) / ".ninja_log").string();
+      if(profile)
+        print(m::Profile(p, m::read_ninja_log(log)));
+      else if(deps)
+        print(m::DepsReport(p, fs::exists(log) ? m::read_ninja_log(log)
+            : std::vector<m::LogEntry>{}, jobs(args)));
+      else
+        print(m::TimeReport(p, jobs(args)));
+      return 0;
+    }
+    if(verify_only)
+      return verify_reproducible(program, topdir, builddir, args);
+    m::State state(builddir);
+    state.args({program, topdir, builddir});
+    if(!fs::exists("build.ninja") || !state.unchanged())
+    {
+      auto started = std::chrono::steady_clock::now();
+      m::Loader loader(topdir, builddir);
+      m::Project p = loader.load_file(_m);
+      if(show_timings)
+        timing("load", started);
+      auto inputs = loader.inputs();
+      const auto& directories = loader.directories();
+      if(!program.empty())
+      {
+        inputs.push_back(program);
+        auto all = inputs;
+        all.insert(all.end(), directories.begin(), directories.end());
+        p.generator(program, start > 1 ? program + " " + topdir : program, all);
+      }
+      p.fetch(jobs(args));
+      auto generate = std::chrono::steady_clock::now();
+      std::ostringstream out;
+      p.generate(out);
+      m::write_if_changed("build.ninja", out.str());
+      if(show_timings)
+      {
+        timing("generate", generate);
+        timing("total", started);
+      }
+      // The externals are not inputs of build.ninja but they have to
+      // be fetched again if a checkout is removed or changed.
+      auto externals = p.externals();
+      inputs.insert(inputs.end(), externals.begin(), externals.end());
+      state.inputs(inputs);
+      state.directories(directories, "_m");
+      state.save();
+    }
+    else
+      m::update_pools(builddir);
+    if(generate_only)
+      return 0;
     fs::path ninja = bp::search_path("ninja");
     if(ninja.empty())
       throw std::runtime_error("Can't find program 'ninja'");
-    bp::system(ninja, args);
+    std::string launcher;
+    CacheStats before;
+    if(show_stats)
+    {
+      launcher = ninja_variable("launcher");
+      if(launcher.empty())
+        throw std::runtime_error("--stats: no compiler launcher in build.ninja");
+      before = cache_stats(launcher);
+    }
+    // The exit status of ninja is passed on so that a failed build
+    // makes 'm' fail too.
+    auto status = bp::system(ninja, args);
+    if(show_stats)
+      report_stats(launcher, before, cache_stats(launcher));
+    return status;
   }
   catch(const std::runtime_error& e)
   {
     std::cerr << e.what() << std::endl;
+    return 1;
   }
-  return 0;
 }
@@ -15,17 +15,67 @@
 #pragma once
 
 #include <algorithm>
+#include <cstdint>
+#include <deque>
 #include <map>
 #include <string>
 #include <set>
+#include <sstream>
+#include <unordered_map>
 #include <vector>
 #include <iostream>
-#include <regex>
 #include "preamble.hh"
 
 using namespace std::literals::string_literals;
 
 namespace m {
+// A string stored once, shared by everything using the same flag,
+// define, path or source name.  Symbols compare and hash by address.
+class Symbol
+{
+  public:
+    Symbol() : _string(&empty_string()) {}
+    Symbol(const std::string& s) : _string(&intern(s)) {}
+    Symbol(const char* s) : _string(&intern(s)) {}
+    const std::string& str() const { return *_string; }
+    operator const std::string&() const { return *_string; }
+    bool empty() const { return _string->empty(); }
+    char operator[](std::size_t i) const { return (*_string)[i]; }
+    bool operator==(const Symbol& o) const { return _string == o._string; }
+    bool operator!=(const Symbol& o) const { return _string != o._string; }
+    std::size_t hash() const { return reinterpret_cast<std::uintptr_t>(_string); }
+  private:
+    static const std::string& intern(const std::string&);
+    static const std::string& empty_string()
+    {
+      static const std::string& empty = intern({});
+      return empty;
+    }
+    const std::string* _string;
+};
+
+inline std::ostream& operator<<(std::ostream& out, const Symbol& s)
+{
+  return out << s.str();
+}
+
+inline std::string operator+(const std::string& a, const Symbol& b)
+{
+  return a + b.str();
+}
+}
+
+namespace std {
+template<>
+struct hash<m::Symbol>
+{
+  std::size_t operator()(const m::Symbol& s) const { return s.hash(); }
+};
+}
+
+namespace m {
+// Owns the objects created by name.  They're allocated in a deque,
+// which never moves them, and live until the program ends.
 template<typename T, typename ...Args>
 class Factory
 {
@@ -35,9 +85,9 @@ class Factory
       auto i = _registry.find(name);
       if(i != _registry.end())
         return *i->second;
-      auto t = new T(name, args...);
-      _registry.insert(std::make_pair(name, t));
-      return *t;
+      _arena.emplace_back(name, args...);
+      _registry.emplace(name, &_arena.back());
+      return _arena.back();
     }
     static const T* get(const std::string& name)
     {
@@ -47,12 +97,15 @@ class Factory
       return nullptr;
     }
   private:
-    using map = std::map<std::string, T*>;
+    using map = std::unordered_map<std::string, T*>;
     static map _registry;
+    static std::deque<T> _arena;
 };
 
 template<typename T, typename... Args>
 typename Factory<T, Args...>::map Factory<T, Args...>::_registry;
+template<typename T, typename... Args>
+std::deque<T> Factory<T, Args...>::_arena;
 
 class expand_type
 {
@@ -61,6 +114,10 @@ class expand_type
     expand_type(T&&...) {}
 };
 
+// A vector without duplicates keeping the order elements were added
+// in.  Short vectors are searched linearly.  Longer ones index the
+// elements in an open addressing hash table, so each element is only
+// stored once.
 template<typename T>
 class unique_vector
 {
@@ -68,14 +125,51 @@ class unique_vector
     unique_vector() {}
     void push_back(const T& t)
     {
-      bool b = _set.insert(t).second;
-      if(b)
+      if(_index.empty())
+      {
+        if(std::find(_vector.begin(), _vector.end(), t) != _vector.end())
+          return;
         _vector.push_back(t);
+        if(_vector.size() == linear)
+          rehash(4 * linear);
+        return;
+      }
+      if(2 * (_vector.size() + 1) > _index.size())
+        rehash(2 * _index.size());
+      auto& slot = find(t);
+      if(slot == 0)
+      {
+        _vector.push_back(t);
+        slot = static_cast<std::uint32_t>(_vector.size());
+      }
     }
     const std::vector<T>& vector() const { return _vector; }
   private:
-    std::set<T> _set;
+    static constexpr std::size_t linear = 16;
+    // The slot holding t or the empty slot where it belongs.  Slots
+    // hold the index in the vector plus one.
+    std::uint32_t& find(const T& t)
+    {
+      // Fibonacci hashing spreads pointer and symbol hashes, which
+      // have their low bits in common.
+      auto mask = _index.size() - 1;
+      std::size_t i = (std::hash<T>()(t) * 0x9e3779b97f4a7c15ull) >> _shift;
+      while(_index[i] != 0 && !(_vector[_index[i] - 1] == t))
+        i = (i + 1) & mask;
+      return _index[i];
+    }
+    void rehash(std::size_t size)
+    {
+      _index.assign(size, 0);
+      _shift = 64;
+      for(auto n = size; n > 1; n >>= 1)
+        --_shift;
+      for(std::size_t i = 0; i != _vector.size(); ++i)
+        find(_vector[i]) = static_cast<std::uint32_t>(i + 1);
+    }
     std::vector<T> _vector;
+    std::vector<std::uint32_t> _index;
+    int _shift = 64;
 };
 
 template<typename T, typename F>
@@ -85,21 +179,95 @@ void print(const T& t, std::ostream& out, const std::string& prefix, F f)
     return;
   out << prefix;
   std::for_each(std::begin(t), std::end(t), f);
-  out << std::endl;
+  out << '\n';
 }
 
+// A 64 bit FNV-1a hash.  It's the same from run to run so it can be
+// saved to tell if what a generated file depends on has changed.
+class Digest
+{
+  public:
+    Digest& operator<<(std::uint64_t n)
+    {
+      for(int i = 0; i != 64; i += 8)
+        add(static_cast<unsigned char>(n >> i));
+      return *this;
+    }
+    Digest& operator<<(const std::string& s)
+    {
+      *this << static_cast<std::uint64_t>(s.size());
+      for(unsigned char c: s)
+        add(c);
+      return *this;
+    }
+    template<typename T>
+    Digest& operator<<(const std::vector<T>& v)
+    {
+      *this << static_cast<std::uint64_t>(v.size());
+      for(const auto& i: v)
+        *this << i;
+      return *this;
+    }
+    std::uint64_t value() const { return _value; }
+  private:
+    void add(unsigned char c)
+    {
+      _value = (_value ^ c) * 1099511628211ull;
+    }
+    std::uint64_t _value = 14695981039346656037ull;
+};
+
+// Writes 'content' to 'file' unless the file already has exactly
+// that content, in which case its mtime is left alone.  The file is
+// replaced atomically.  Returns true if the file was written.
+bool write_if_changed(const std::string& file, const std::string& content);
+
+// Sizes the automatic pools in $builddir/.m/pools.ninja again from the
+// recorded peak memory use and the memory available now.  Does nothing
+// if there are no automatic pools.
+void update_pools(const std::string& builddir);
+
 class External
 {
   public:
-    External(const std::string& url, const std::string& hash)
-      : _url(url), _hash(hash)
+    // How much of the repository to download.  SHALLOW fetches only
+    // the pinned commit and PARTIAL leaves out blobs until they are
+    // needed by the checkout.
+    enum class Mode { FULL, SHALLOW, PARTIAL };
+    External(const std::string& url, const std::string& hash, Mode mode = Mode::FULL)
+      : _url(url), _hash(hash), _mode(mode)
     {
     }
     const std::string& url() const { return _url; }
     const std::string& hash() const { return _hash; }
+    Mode mode() const { return _mode; }
+    // Paths to check out, or everything if empty.
+    void sparse(const std::string& path) { _sparse.push_back(path); }
+    const std::vector<std::string>& sparse() const { return _sparse; }
   private:
     const std::string _url;
     const std::string _hash;
+    const Mode _mode;
+    std::vector<std::string> _sparse;
+};
+
+// The compilers used by the generated rules.  Which compiler 'c++'
+// is is only found out when something depends on it.
+class Toolchain
+{
+  public:
+    enum class Compiler { UNKNOWN, GCC, CLANG };
+    Toolchain() : _compiler(Compiler::UNKNOWN) {}
+    Compiler compiler() const;
+    bool clang() const { return compiler() == Compiler::CLANG; }
+    // The archiver to use, which has to understand the compiler's
+    // intermediate code when building with link time optimization.
+    std::string ar(bool lto) const;
+    // The fastest linker installed of mold, lld and gold, given as the
+    // argument to -fuse-ld, or an empty string if there is none.
+    std::string fast_linker() const;
+  private:
+    mutable Compiler _compiler;
 };
 
 class Project;
@@ -108,7 +276,8 @@ class Library;
 class Object
 {
   public:
-    Object(const std::string& name) : _name(name), _header_only(true), _compiled(false) {}
+    Object(const std::string& name)
+      : _unity(-1), _header_only(true), _compiled(false), _name(name) {}
     virtual ~Object() {}
     const std::string& name() const { return _name; }
     template<typename ...T>
@@ -128,10 +297,12 @@ class Object
     }
     void incs(const std::string& include)
     {
+      unshare();
       _include_path.push_back(include);
     }
     virtual void libs(const std::string& lib)
     {
+      unshare();
       _library_path.push_back(lib);
       _header_only = false;
     }
@@ -145,8 +316,25 @@ class Object
     }
     void add_def(const std::string& def)
     {
+      unshare();
       _defines.push_back(def);
     }
+    void pch(const std::string& header)
+    {
+      _pch = header;
+    }
+    void unity(int sources)
+    {
+      _unity = sources;
+    }
+    void nounity(const std::string& source)
+    {
+      _nounity.push_back(source);
+    }
+    void pool(const std::string& name)
+    {
+      _pool = name;
+    }
     void add_src(const std::string& source)
     {
       _sources.push_back(source);
@@ -157,11 +345,40 @@ class Object
     {
       _libraries.push_back(&lib);
     }
-    const std::vector<std::string>& defines() const { return _defines; }
-    const std::vector<std::string>& library_path() const { return _library_path; }
-    const std::vector<std::string>& include_path() const { return _include_path; }
+    // The '_m' file defining the object.
+    void input(const Symbol& file) { _input = file; }
+    const Symbol& input() const { return _input; }
+    // Uses the defines and paths of another object instead of copies
+    // until this object changes them.
+    void share(const Object& object) { _shared = &object; }
+    const std::vector<Symbol>& defines() const { return _shared ? _shared->_defines : _defines; }
+    const std::vector<Symbol>& library_path() const
+    {
+      return _shared ? _shared->_library_path : _library_path;
+    }
+    const std::vector<Symbol>& include_path() const
+    {
+      return _shared ? _shared->_include_path : _include_path;
+    }
+    const std::vector<const Library*>& libraries() const { return _libraries; }
+    // All libraries this object depends on, directly or through other
+    // libraries, each one after the libraries it depends on.  Computed
+    // once per object.  Throws on a dependency cycle.
+    const std::vector<const Library*>& dependencies() const;
+    // The include paths of the libraries this object depends on, the
+    // direct dependencies first.
+    std::vector<Symbol> dependency_includes() const;
     const std::string& src_path() const;
     const std::string& extension(const Project&) const;
+    const std::string& pch(const Project&) const;
+    // The precompiled header built for this object, if any.
+    std::string pch_file(const Project&) const;
+    int unity(const Project&) const;
+    // The ninja pool for compiling or linking this object, if any.
+    const std::string& pool(const Project&, bool link) const;
+    // The object files built from the sources, one for each source
+    // compiled on its own and one for each unity source.
+    std::vector<std::string> objects(const Project&) const;
     const std::string& rule(const std::string& ext) const
     {
       static const std::string c{"COMPILE.c"};
@@ -179,20 +396,53 @@ class Object
       throw std::runtime_error("Unknown extension: "s + ext);
     }
     virtual void generate(std::ostream&, const Project&) const {}
+    // Adds everything the edges written by generate() depend on,
+    // except the libraries this object depends on.
+    virtual void digest(Digest&, const Project&) const;
   protected:
-    std::vector<std::string> _ccflags;
-    std::vector<std::string> _cflags;
-    std::vector<std::string> _ldflags;
-    std::string _source_path;
-    std::string _extension;
-    std::vector<std::string> _defines;
-    std::vector<std::string> _include_path;
-    std::vector<std::string> _library_path;
-    std::vector<std::string> _sources;
+    // Writes the compile edges for the sources, preceded by the edge
+    // for the precompiled header if there is one.
+    void generate_sources(std::ostream& out, const Project& project,
+      const std::vector<Symbol>& defines, const std::vector<Symbol>& includes,
+      const std::vector<Symbol>& framework_path = {}) const;
+    // Splits the sources into those compiled on their own and groups
+    // of sources included by a unity source.
+    void partition(const Project&, std::vector<Symbol>& single,
+      std::vector<std::vector<Symbol>>& unity) const;
+    void unshare()
+    {
+      if(!_shared)
+        return;
+      _defines = _shared->_defines;
+      _include_path = _shared->_include_path;
+      _library_path = _shared->_library_path;
+      _shared = nullptr;
+    }
+    // Extra compile flags needed by the kind of object being built.
+    virtual std::string soflags(const Project&) const { return {}; }
+    std::vector<Symbol> _ccflags;
+    std::vector<Symbol> _cflags;
+    std::vector<Symbol> _ldflags;
+    Symbol _source_path;
+    Symbol _extension;
+    Symbol _pch;
+    int _unity;
+    std::vector<Symbol> _nounity;
+    Symbol _pool;
+    std::vector<Symbol> _defines;
+    std::vector<Symbol> _include_path;
+    std::vector<Symbol> _library_path;
+    std::vector<Symbol> _sources;
     std::vector<const Library*> _libraries;
+    const Object* _shared = nullptr;
+    Symbol _input;
     bool _header_only;
     bool _compiled;
   private:
+    const std::vector<const Library*>& dependencies(std::vector<const Object*>& path) const;
+    enum class Visit { NEW, ACTIVE, DONE };
+    mutable Visit _visit = Visit::NEW;
+    mutable std::vector<const Library*> _dependencies;
     const std::string _name;
 };
 
@@ -204,56 +454,83 @@ class Library : public Object, public Factory<Library>
     bool header_only() const { return _header_only; }
     void header_only(bool x) { _header_only = x; }
     bool compiled() const { return _compiled; }
-    void url(const std::string& url, const std::string& hash)
+    void url(const std::string& url, const std::string& hash,
+      External::Mode mode = External::Mode::FULL)
+    {
+      _external.reset(new External(url, hash, mode));
+    }
+    void sparse(const std::string& path)
+    {
+      if(!_external)
+        throw std::runtime_error("sparse: no 'url' given for library " + name());
+      _external->sparse(path);
+    }
+    const External* external() const { return _external.get(); }
+    // THIN archives only refer to the objects and OBJECTS libraries
+    // have no archive, their objects are linked directly.
+    enum class Type { DEFAULT, STATIC, THIN, OBJECTS, SHARED };
+    void type(Type type)
+    {
+      _type = type;
+    }
+    Type type(const Project&) const;
+    void visibility(const std::string& visibility)
     {
-      _external.reset(new External(url, hash));
+      _visibility = visibility;
     }
-    void fetch(const Project& project) const;
+    // The file name of the library, e.g. libhello.a.  An object
+    // library has no file and the name is only used for the phony
+    // target.
+    std::string file(const Project&) const;
+    // The file a binary linking with the library depends on.  For a
+    // shared library it's the interface stub listing its exported
+    // symbols, which only changes when the interface does.
+    std::string dependency(const Project&) const;
+    virtual void digest(Digest&, const Project&) const override;
     virtual void generate(std::ostream& out, const Project& project) const override
     {
-      fetch(project);
       if(!_sources.empty())
       {
-        out << std::endl << "# lib: " << name() << std::endl;
-        unique_vector<std::string> defines_v;
-        unique_vector<std::string> includes_v;
+        out << "\n# lib: " << name() << '\n';
+        unique_vector<Symbol> defines_v;
+        unique_vector<Symbol> includes_v;
         for(const auto& def: defines())
           defines_v.push_back(def);
         for(const auto& inc: include_path())
           includes_v.push_back(inc);
-        for(const auto& l: _libraries)
+        for(const auto& inc: dependency_includes())
+          includes_v.push_back(inc);
+        generate_sources(out, project, defines_v.vector(), includes_v.vector());
+        auto lib = file(project);
+        if(type(project) == Type::OBJECTS)
         {
-          for(const auto& inc: l->include_path())
-            includes_v.push_back(inc);
+          out << "build " << lib << "$variant: phony";
+          for(const auto& i: objects(project))
+            out << " " << i;
+          out << '\n';
+          return;
         }
-        for(const auto& i: _sources)
+        out << "build " << lib << "$variant: phony $builddir/lib/" << lib << '\n';
+        if(type(project) == Type::SHARED)
+          generate_shared(out, project);
+        else
         {
-          std::string src = src_path();
-          if(!src.empty())
-            src += '/';
-          out << "build $builddir/obj/" << name() << "/" << i << ".o: "
-            << rule(extension(project)) << " $topdir/"
-            << src << i << extension(project) << std::endl;
-          print(_ccflags, out, " ccflags =", [&out](const auto& s) { out << " " << s; });
-          print(_ccflags, out, " cflags =", [&out](const auto& s) { out << " " << s; });
-          print(defines_v.vector(), out, " -D =", [&out](const auto& s) { out << " " << s; });
-          print(includes_v.vector(), out, " -I =",
-            [&out](const auto& s) {
-              if(s[0] == '/')
-                out << " -I" << s;
-              else
-                out << " -I$topdir/" << s;
-            });
+          out << "build $builddir/lib/" << lib << ": ARCHIVE";
+          for(const auto& i: objects(project))
+            out << " " << i;
+          out << '\n';
+          if(type(project) == Type::THIN)
+            out << " arflags = ${arflags}sT\n";
         }
-        out << "build lib" << name() << ".a: phony $builddir/lib/lib" << name() << ".a" << std::endl;
-        out << "build $builddir/lib/lib" << name() << ".a: ARCHIVE";
-        for(const auto& i: _sources)
-          out << " $builddir/obj/" << name() << "/" << i << ".o";
-        out << std::endl;
       }
     }
+  protected:
+    virtual std::string soflags(const Project&) const override;
   private:
+    void generate_shared(std::ostream& out, const Project& project) const;
     std::shared_ptr<External> _external;
+    Type _type = Type::DEFAULT;
+    Symbol _visibility;
 };
 
 class Framework : public Object, public Factory<Framework>
@@ -283,26 +560,28 @@ class Template : public Library, public Factory<Template>
       if(libraryp)
         return *libraryp;
       auto& library = Factory<Library>::create(template_name(library_name));
-      for(auto i: _defines)
-        library.add_def(i);
-      for(auto i: _include_path)
-        library.incs(i);
-      for(auto i: _library_path)
-        library.libs(i);
+      library.share(*this);
       library.header_only(false);
       return library;
     }
   private:
+    // Replaces every '%' in the template with 'name'.
     const std::string template_name(const std::string& name) const
     {
-      static const std::regex re("%");
-      return std::regex_replace(_template, re, name);
+      std::string result;
+      for(auto c: _template)
+        if(c == '%')
+          result += name;
+        else
+          result += c;
+      return result;
     }
     const std::string _template;
 };
 
 class Binary : public Object, public Factory<Binary>
 {
+    static const std::string rpath;
   public:
     Binary(const std::string& name) : Object(name) {}
     virtual ~Binary() {}
@@ -311,33 +590,46 @@ class Binary : public Object, public Factory<Binary>
     {
       _frameworks.push_back(std::make_pair(&framework, name));
     }
+    virtual void digest(Digest&, const Project&) const override;
     virtual void generate(std::ostream& out, const Project& project) const override
     {
-      out << std::endl << "# bin: " << name() << std::endl;
+      out << "\n# bin: " << name() << '\n';
       unique_vector<std::string> libs_v;
-      unique_vector<std::string> defines_v;
-      unique_vector<std::string> includes_v;
-      unique_vector<std::string> libsearch_v;
-      unique_vector<std::string> frameworksearch_v;
+      unique_vector<Symbol> defines_v;
+      unique_vector<Symbol> includes_v;
+      unique_vector<Symbol> libsearch_v;
+      unique_vector<Symbol> frameworksearch_v;
       unique_vector<std::string> frameworks_v;
       unique_vector<std::string> deps_v;
+      unique_vector<std::string> shared_v;
       for(const auto& def: defines())
         defines_v.push_back(def);
       for(const auto& inc: include_path())
         includes_v.push_back(inc);
-      for(const auto& l: _libraries)
+      for(const auto& inc: dependency_includes())
+        includes_v.push_back(inc);
+      // Link with a library before the libraries it depends on.
+      const auto& dependencies = this->dependencies();
+      unique_vector<std::string> objects_v;
+      for(auto l = dependencies.rbegin(); l != dependencies.rend(); ++l)
       {
+        if((*l)->compiled() && (*l)->type(project) == Library::Type::OBJECTS)
+        {
+          for(const auto& o: (*l)->objects(project))
+            objects_v.push_back(o);
+          continue;
+        }
+        if(!(*l)->header_only())
         {
-          if(!l->header_only())
+          libs_v.push_back((*l)->name());
+          if((*l)->compiled())
           {
-            libs_v.push_back(l->name());
-            if(l->compiled())
-              deps_v.push_back(l->name());
+            deps_v.push_back((*l)->dependency(project));
+            if((*l)->type(project) == Library::Type::SHARED)
+              shared_v.push_back("$builddir/lib/" + (*l)->file(project));
           }
         }
-        for(const auto& inc: l->include_path())
-          includes_v.push_back(inc);
-        for(const auto& lib: l->library_path())
+        for(const auto& lib: (*l)->library_path())
           libsearch_v.push_back(lib);
       }
       for(const auto& f: _frameworks)
@@ -346,34 +638,30 @@ class Binary : public Object, public Factory<Binary>
         includes_v.push_back(f.first->path() + "/"s + f.second + ".framework/Headers"s);
         frameworksearch_v.push_back(f.first->path());
       }
-      for(const auto& i: _sources)
-      {
-        std::string src = src_path();
-        if(!src.empty())
-          src += '/';
-        out << "build $builddir/obj/" << name() << "/" << i << ".o: "
-          << rule(extension(project)) << " $topdir/"
-          << src << i << extension(project) << std::endl;
-        print(_ccflags, out, " ccflags =", [&out](const auto& s) { out << " " << s; });
-        print(_cflags, out, " cflags =", [&out](const auto& s) { out << " " << s; });
-        print(defines_v.vector(), out, " -D =", [&out](const auto& s) { out << " " << s; });
-        print(includes_v.vector(), out, " -I =",
-          [&out](const auto& s) {
-            if(s[0] == '/')
-              out << " -I" << s;
-            else
-              out << " -I$topdir/" << s;
-          });
-        print(frameworksearch_v.vector(), out, " -F =", [&out](const auto& s) { out << " -F" << s; });
-      }
-      out << "build " << name() << ": phony $builddir/bin/" << name() << std::endl;
+      generate_sources(out, project, defines_v.vector(), includes_v.vector(),
+        frameworksearch_v.vector());
+      out << "build " << name() << "$variant: phony $builddir/bin/" << name() << '\n';
       out << "build $builddir/bin/" << name() << ": LINK.cc";
-      for(const auto& i: _sources)
-        out << " $builddir/obj/" << name() << "/" << i << ".o";
-      print(deps_v.vector(), out, " |", [&out](const auto& s) { out << " $builddir/lib/lib" << s << ".a"; });
-      if(deps_v.vector().empty())
-        out << std::endl;
+      for(const auto& i: objects(project))
+        out << " " << i;
+      for(const auto& i: objects_v.vector())
+        out << " " << i;
+      if(!deps_v.vector().empty())
+        out << " |";
+      for(const auto& i: deps_v.vector())
+        out << " " << i;
+      // The shared libraries only have to exist when linking.
+      if(!shared_v.vector().empty())
+        out << " ||";
+      for(const auto& i: shared_v.vector())
+        out << " " << i;
+      out << '\n';
+      if(!shared_v.vector().empty())
+        out << " rpath = " << rpath << '\n';
       print(_ldflags, out, " ldflags =", [&out](const auto& s) { out << " " << s; });
+      const auto& link_pool = pool(project, true);
+      if(!link_pool.empty())
+        out << " pool = " << link_pool << '\n';
       print(libsearch_v.vector(), out, " -L =", [&out](const auto& s) { out << " -L" << s; });
       print(libs_v.vector(), out, " -l =", [&out](const auto& s) { out << " -l" << s; });
       print(frameworksearch_v.vector(), out, " -F =", [&out](const auto& s) { out << " -F" << s; });
@@ -383,19 +671,59 @@ class Binary : public Object, public Factory<Binary>
     std::vector<std::pair<const Framework*, const std::string>> _frameworks;
 };
 
+// A set of flags added to every compile and link for building the
+// whole project in its own directory, e.g. 'release' or 'asan'.
+class Variant
+{
+  public:
+    Variant(const std::string& name) : _name(name) {}
+    const std::string& name() const { return _name; }
+    void ccflags(const std::string& flag) { _ccflags.push_back(flag); }
+    void cflags(const std::string& flag) { _cflags.push_back(flag); }
+    void ldflags(const std::string& flag) { _ldflags.push_back(flag); }
+    void add_def(const std::string& def) { _defines.push_back(def); }
+    void generate(std::ostream& out) const
+    {
+      out << "builddir = $builddir/" << _name << '\n';
+      out << "variant = @" << _name << '\n';
+      print(_ccflags, out, "variant_ccflags =", [&out](const auto& s) { out << " " << s; });
+      print(_cflags, out, "variant_cflags =", [&out](const auto& s) { out << " " << s; });
+      print(_ldflags, out, "variant_ldflags =", [&out](const auto& s) { out << " " << s; });
+      print(_defines, out, "variant_defines =", [&out](const auto& s) { out << " " << s; });
+    }
+  private:
+    const std::string _name;
+    std::vector<Symbol> _ccflags;
+    std::vector<Symbol> _cflags;
+    std::vector<Symbol> _ldflags;
+    std::vector<Symbol> _defines;
+};
+
 class Project
 {
   public:
     Project(const std::string& name, const std::string& topdir, const std::string& builddir)
-      : _name(name), _topdir(topdir), _builddir(builddir) {}
+      : _name(name), _topdir(topdir), _builddir(builddir), _unity(0),
+        _compile_jobs(0), _link_jobs(0), _lto(Lto::NONE), _type(Library::Type::STATIC),
+        _link_profile(LinkProfile::DEFAULT), _time_trace(false), _reproducible(false) {}
     // No copy allowed.
     Project(const Project& o) = delete;
     Project(Project&& o) noexcept
       : _name(o._name), _topdir(o._topdir), _builddir(o._builddir),
-        _ccflags(o._ccflags), _cflags(o._cflags), _ldflags(o._ldflags),
-        _source_path(o._source_path), _extension(o._extension),
-        _include_path(o._include_path), _library_path(o._library_path),
-        _binaries(o._binaries), _libraries(o._libraries)
+        _ccflags(std::move(o._ccflags)), _cflags(std::move(o._cflags)),
+        _ldflags(std::move(o._ldflags)), _source_path(std::move(o._source_path)),
+        _extension(std::move(o._extension)), _pch(std::move(o._pch)),
+        _include_path(std::move(o._include_path)), _library_path(std::move(o._library_path)),
+        _binaries(std::move(o._binaries)), _libraries(std::move(o._libraries)),
+        _program(std::move(o._program)), _generator(std::move(o._generator)),
+        _inputs(std::move(o._inputs)), _input(o._input), _unity(o._unity),
+        _launcher(std::move(o._launcher)), _link_launcher(std::move(o._link_launcher)),
+        _cache_dir(std::move(o._cache_dir)), _compile_jobs(o._compile_jobs),
+        _link_jobs(o._link_jobs), _pools(std::move(o._pools)), _lto(o._lto),
+        _variants(std::move(o._variants)), _type(o._type),
+        _visibility(std::move(o._visibility)), _link_profile(o._link_profile),
+        _time_trace(o._time_trace), _reproducible(o._reproducible),
+        _generated(std::move(o._generated)), _toolchain(o._toolchain)
     {
     }
     ~Project()
@@ -404,7 +732,14 @@ class Project
     const std::string& name() const { return _name; }
     const std::string& topdir() const { return _topdir; }
     const std::string& builddir() const { return _builddir; }
-    void fetch(const std::string& name, const std::string& url, const std::string& hash) const;
+    void fetch(const std::string& name, const External& external) const;
+    // Fetch all external libraries running at most 'jobs' fetches at
+    // the same time.
+    void fetch(unsigned jobs) const;
+    // Files showing the state of each external library's checkout.
+    // If any of them changes or goes missing the libraries are fetched
+    // again.
+    std::vector<std::string> externals() const;
     template<typename ...T>
     void ccflags(T... args)
     {
@@ -436,6 +771,89 @@ class Project
     {
       _extension = extension;
     }
+    void pch(const std::string& header)
+    {
+      _pch = header;
+    }
+    void unity(int sources)
+    {
+      _unity = sources;
+    }
+    // The program put in front of the compiler, e.g. ccache, or
+    // "auto" to use ccache or sccache if either is installed.
+    void launcher(const std::string& program)
+    {
+      _launcher = program;
+    }
+    void link_launcher(const std::string& program)
+    {
+      _link_launcher = program;
+    }
+    void cache_dir(const std::string& dir)
+    {
+      _cache_dir = dir;
+    }
+    // Limits the number of compile or link jobs run at the same time.
+    // A negative number sizes the pool from the peak memory use of
+    // earlier builds.
+    void compile_jobs(int jobs)
+    {
+      _compile_jobs = jobs;
+    }
+    void link_jobs(int jobs)
+    {
+      _link_jobs = jobs;
+    }
+    void pool(const std::string& name, int depth)
+    {
+      _pools.emplace_back(name, depth);
+    }
+    bool has_pool(const std::string& name) const;
+    Variant& variant(const std::string& name);
+    void type(Library::Type type)
+    {
+      _type = type;
+    }
+    Library::Type type() const { return _type; }
+    void visibility(const std::string& visibility)
+    {
+      _visibility = visibility;
+    }
+    const std::string& visibility() const { return _visibility; }
+    enum class LinkProfile { DEFAULT, FAST };
+    void link_profile(LinkProfile profile)
+    {
+      _link_profile = profile;
+    }
+    // Objects are compiled with split DWARF in the fast link profile.
+    bool split_dwarf() const { return _link_profile == LinkProfile::FAST; }
+    void time_trace(bool trace)
+    {
+      _time_trace = trace;
+    }
+    // Clang writes a trace of each compile next to the object.
+    bool time_trace() const { return _time_trace && _toolchain.clang(); }
+    void reproducible(bool reproducible)
+    {
+      _reproducible = reproducible;
+    }
+    // GCC names the LTO sections of an object using a random seed
+    // unless one is given.
+    bool random_seed() const
+    {
+      return _reproducible && _lto != Lto::NONE && !_toolchain.clang();
+    }
+    enum class Lto { NONE, FULL, THIN };
+    void lto(Lto mode)
+    {
+      _lto = mode;
+    }
+    const std::string& compile_pool() const;
+    const std::string& link_pool() const;
+    // The launcher command including the environment settings for
+    // the compiler cache, or an empty string if there is none.
+    std::string launcher() const;
+    bool has_launcher() const { return !launcher_program().empty(); }
     void add(const Binary& bin)
     {
       _binaries.push_back(&bin);
@@ -444,6 +862,20 @@ class Project
     {
       _libraries.push_back(&lib);
     }
+    // The command used by ninja to regenerate build.ninja when any of
+    // the inputs change.  The program is 'm' itself, whose version
+    // decides if generated fragments can be reused.
+    void generator(const std::string& program, const std::string& command,
+      const std::vector<std::string>& inputs)
+    {
+      _program = program;
+      _generator = command;
+      _inputs = inputs;
+    }
+    // The '_m' file being loaded.  Libraries and binaries remember
+    // which file defines them.
+    void input(const Symbol& file) { _input = file; }
+    const Symbol& input() const { return _input; }
     const std::string& extension() const
     {
       if(!_extension.empty())
@@ -455,11 +887,46 @@ class Project
     {
       return _source_path;
     }
-    void generate(std::ostream& out) const
-    {
-      out << preamble[0] << std::endl << std::endl;
-      out << "topdir = " << _topdir << std::endl;
-      out << "builddir = " << _builddir << std::endl;
+    const std::string& pch() const { return _pch; }
+    int unity() const { return _unity; }
+    const std::vector<const Library*>& libraries() const { return _libraries; }
+    const std::vector<const Binary*>& binaries() const { return _binaries; }
+    const std::deque<Variant>& variants() const { return _variants; }
+    // Files written while generating build.ninja.  They become outputs
+    // of the edge regenerating build.ninja so that ninja recreates
+    // them if they go missing.
+    void generated(const std::string& file) const
+    {
+      _generated.push_back(file);
+    }
+    const Toolchain& toolchain() const { return _toolchain; }
+    void generate(std::ostream& os) const
+    {
+      std::ostringstream out;
+      out << preamble[0] << "\n\n";
+      out << "topdir = " << _topdir << '\n';
+      out << "builddir = " << _builddir << '\n';
+      out << "unitydir = $builddir/unity\n";
+      if(!_generator.empty())
+        out << "m = " << _generator << '\n';
+      auto compile_launcher = launcher();
+      if(!compile_launcher.empty())
+        out << "launcher = " << compile_launcher << '\n';
+      if(!_link_launcher.empty())
+        out << "link_launcher = " << _link_launcher << '\n';
+      if(!_generator.empty() && (_compile_jobs < 0 || _link_jobs < 0))
+        out << "rss = $m --rss $builddir --\n";
+      generate_lto(out);
+      generate_link_profile(out);
+      if(_time_trace)
+      {
+        if(_toolchain.clang())
+          out << "traceflags = -ftime-trace\n";
+        else
+          std::cerr << "time_trace: ignored, -ftime-trace needs Clang\n";
+      }
+      if(_reproducible)
+        generate_reproducible(out);
       print(_ccflags, out, "ccflags =", [&out](const auto& s) { out << " " << s; });
       print(_cflags, out, "cflags =", [&out](const auto& s) { out << " " << s; });
       print(_ldflags, out, "ldflags =", [&out](const auto& s) { out << " " << s; });
@@ -470,29 +937,75 @@ class Project
           else
             out << "$topdir/" << s;
         });
-      out << std::endl << preamble[1] << std::endl;
-      for(const auto& i: _libraries)
-      {
-        i->generate(out, *this);
-      }
-      for(const auto& i: _binaries)
+      out << '\n' << preamble[1] << '\n';
+      _generated.clear();
+      generate_pools(out);
+      // The edges depend on everything written so far as well as on
+      // some settings which only show in the edges.
+      Digest digest;
+      digest << out.str() << split_dwarf() << time_trace() << random_seed();
+      std::ostringstream targets;
+      generate_fragments(targets, digest);
+      generate_variants(targets, targets.str());
+      if(!_generator.empty())
       {
-        i->generate(out, *this);
+        out << "\nbuild build.ninja";
+        if(!_generated.empty())
+          out << " |";
+        for(const auto& i: _generated)
+          out << " " << i;
+        out << ": REGENERATE";
+        for(const auto& i: _inputs)
+          out << " " << i;
+        out << '\n';
       }
+      os << out.str() << targets.str();
     }
   private:
+    // The compiler cache or distributed compiler to run, or an empty
+    // string if there is none.
+    std::string launcher_program() const;
     const std::string _name;
     const std::string _topdir;
     const std::string _builddir;
-    std::vector<std::string> _ccflags;
-    std::vector<std::string> _cflags;
-    std::vector<std::string> _ldflags;
+    std::vector<Symbol> _ccflags;
+    std::vector<Symbol> _cflags;
+    std::vector<Symbol> _ldflags;
     std::string _source_path;
     std::string _extension;
-    std::vector<std::string> _include_path;
-    std::vector<std::string> _library_path;
+    std::string _pch;
+    std::vector<Symbol> _include_path;
+    std::vector<Symbol> _library_path;
     std::vector<const Binary*> _binaries;
     std::vector<const Library*> _libraries;
+    std::string _program;
+    std::string _generator;
+    std::vector<std::string> _inputs;
+    Symbol _input;
+    int _unity;
+    std::string _launcher;
+    std::string _link_launcher;
+    std::string _cache_dir;
+    int _compile_jobs;
+    int _link_jobs;
+    std::vector<std::pair<std::string, int>> _pools;
+    Lto _lto;
+    std::deque<Variant> _variants;
+    Library::Type _type;
+    std::string _visibility;
+    LinkProfile _link_profile;
+    bool _time_trace;
+    bool _reproducible;
+    mutable std::vector<std::string> _generated;
+    Toolchain _toolchain;
+    void generate_pools(std::ostream&) const;
+    void generate_lto(std::ostream&) const;
+    void generate_link_profile(std::ostream&) const;
+    void generate_reproducible(std::ostream&) const;
+    void generate_variants(std::ostream&, const std::string& targets) const;
+    // Writes the edges of each '_m' file to a subninja of its own,
+    // reusing those which haven't changed, and includes them.
+    void generate_fragments(std::ostream&, const Digest&) const;
 };
 
 class BuilderBase
@@ -502,12 +1015,19 @@ class BuilderBase
       : _project(project)
     {}
     virtual ~BuilderBase() {}
-    operator Project() { delete _current; _current = nullptr; return std::move(_project); }
+    operator Project()
+    {
+      auto& project = _project;
+      delete _current;
+      _current = nullptr;
+      return std::move(project);
+    }
     Project& project() { return _project; }
     BuilderBase& lib(const std::string& name);
     BuilderBase& lib(const std::string& name, const std::string& pattern);
     BuilderBase& frameworks(const std::string& name, const std::string& path);
     BuilderBase& bin(const std::string& name);
+    BuilderBase& variant(const std::string& name);
     template<typename ...T>
     BuilderBase& ccflags(T... arg)
     {
@@ -533,7 +1053,25 @@ class BuilderBase
     virtual BuilderBase& libs(const std::string&) { return error("libs"); }
     virtual BuilderBase& srcs(const std::string&) { return error("srcs"); }
     virtual BuilderBase& ext(const std::string&) { return error("ext"); }
+    virtual BuilderBase& pch(const std::string&) { return error("pch"); }
+    virtual BuilderBase& unity(int) { return error("unity"); }
+    virtual BuilderBase& launcher(const std::string&) { return error("launcher"); }
+    virtual BuilderBase& link_launcher(const std::string&) { return error("link_launcher"); }
+    virtual BuilderBase& cache_dir(const std::string&) { return error("cache_dir"); }
+    virtual BuilderBase& compile_jobs(int) { return error("compile_jobs"); }
+    virtual BuilderBase& link_jobs(int) { return error("link_jobs"); }
+    virtual BuilderBase& pool(const std::string&) { return error("pool"); }
+    virtual BuilderBase& pool(const std::string&, int) { return error("pool"); }
+    virtual BuilderBase& lto(const std::string&) { return error("lto"); }
+    virtual BuilderBase& type(const std::string&) { return error("type"); }
+    virtual BuilderBase& link_profile(const std::string&) { return error("link_profile"); }
+    virtual BuilderBase& time_trace() { return error("time_trace"); }
+    virtual BuilderBase& reproducible() { return error("reproducible"); }
+    virtual BuilderBase& visibility(const std::string&) { return error("visibility"); }
+    virtual BuilderBase& nounity(const std::string&) { return error("nounity"); }
     virtual BuilderBase& url(const std::string&, const std::string&) { return error("url"); }
+    virtual BuilderBase& url(const std::string&, const std::string&, const std::string&) { return error("url"); }
+    virtual BuilderBase& sparse(const std::string&) { return error("sparse"); }
     virtual BuilderBase& add_src(const std::string&) { return error("add_src"); }
     virtual BuilderBase& add_def(const std::string&) { return error("add_def"); }
     virtual BuilderBase& add_lib(const std::string&) { return error("add_lib"); }
@@ -541,6 +1079,8 @@ class BuilderBase
     virtual BuilderBase& add_framework(const std::string&, const std::string&) { return error("add_framework"); }
   protected:
     virtual void close() {}
+    static Library::Type library_type(const std::string& type);
+    static const std::string& library_visibility(const std::string& visibility);
     Project& _project;
     static BuilderBase* _current;
   private:
@@ -583,11 +1123,119 @@ class ProjectBuilder : public BuilderBase
       project.ext(e);
       return *this;
     }
+    virtual BuilderBase& pch(const std::string& header)
+    {
+      project.pch(header);
+      return *this;
+    }
+    virtual BuilderBase& unity(int sources)
+    {
+      project.unity(sources);
+      return *this;
+    }
+    virtual BuilderBase& launcher(const std::string& program)
+    {
+      project.launcher(program);
+      return *this;
+    }
+    virtual BuilderBase& link_launcher(const std::string& program)
+    {
+      project.link_launcher(program);
+      return *this;
+    }
+    virtual BuilderBase& cache_dir(const std::string& dir)
+    {
+      project.cache_dir(dir);
+      return *this;
+    }
+    virtual BuilderBase& compile_jobs(int jobs)
+    {
+      project.compile_jobs(jobs);
+      return *this;
+    }
+    virtual BuilderBase& link_jobs(int jobs)
+    {
+      project.link_jobs(jobs);
+      return *this;
+    }
+    virtual BuilderBase& pool(const std::string& name, int depth)
+    {
+      project.pool(name, depth);
+      return *this;
+    }
+    virtual BuilderBase& type(const std::string& type)
+    {
+      project.type(library_type(type));
+      return *this;
+    }
+    virtual BuilderBase& visibility(const std::string& visibility)
+    {
+      project.visibility(library_visibility(visibility));
+      return *this;
+    }
+    virtual BuilderBase& time_trace()
+    {
+      project.time_trace(true);
+      return *this;
+    }
+    virtual BuilderBase& reproducible()
+    {
+      project.reproducible(true);
+      return *this;
+    }
+    virtual BuilderBase& link_profile(const std::string& profile)
+    {
+      if(profile == "fast"s)
+      {
+#ifdef __APPLE__
+        // Split DWARF, --gdb-index and compressed debug sections are
+        // ELF features which ld64 doesn't have.
+        throw std::runtime_error("link_profile: 'fast' is not supported on macOS");
+#else
+        project.link_profile(Project::LinkProfile::FAST);
+#endif
+      }
+      else if(profile == "default"s)
+        project.link_profile(Project::LinkProfile::DEFAULT);
+      else
+        throw std::runtime_error("link_profile: unknown profile '" + profile + "'");
+      return *this;
+    }
+    virtual BuilderBase& lto(const std::string& mode)
+    {
+      if(mode == "full"s)
+        project.lto(Project::Lto::FULL);
+      else if(mode == "thin"s)
+        project.lto(Project::Lto::THIN);
+      else if(mode == "none"s)
+        project.lto(Project::Lto::NONE);
+      else
+        throw std::runtime_error("lto: unknown mode '" + mode + "'");
+      return *this;
+    }
 
   private:
     Project project;
 };
 
+class VariantBuilder : public BuilderBase
+{
+  public:
+    VariantBuilder(Project& project, const std::string& name)
+      : BuilderBase(project), _variant(project.variant(name))
+    {}
+    virtual void ccflag(const std::string& flag) { _variant.ccflags(flag); }
+    virtual void cflag(const std::string& flag) { _variant.cflags(flag); }
+    virtual void ldflag(const std::string& flag) { _variant.ldflags(flag); }
+    virtual BuilderBase& add_def(const std::string& def)
+    {
+      _variant.add_def(def);
+      return *this;
+    }
+  private:
+    Variant& _variant;
+};
+
 class LibraryBuilder : public BuilderBase
 {
   public:
@@ -595,6 +1243,7 @@ class LibraryBuilder : public BuilderBase
       : BuilderBase(project), _library(Factory<Library>::create(name))
     {
       _library.srcs(project.src_path());
+      _library.input(project.input());
     }
     virtual ~LibraryBuilder() { close(); }
     virtual void ccflag(const std::string& flag) { _library.ccflags(flag); }
@@ -620,11 +1269,56 @@ class LibraryBuilder : public BuilderBase
       _library.ext(extension);
       return *this;
     }
+    virtual BuilderBase& pch(const std::string& header)
+    {
+      _library.pch(header);
+      return *this;
+    }
+    virtual BuilderBase& unity(int sources)
+    {
+      _library.unity(sources);
+      return *this;
+    }
+    virtual BuilderBase& nounity(const std::string& source)
+    {
+      _library.nounity(source);
+      return *this;
+    }
+    virtual BuilderBase& pool(const std::string& name)
+    {
+      _library.pool(name);
+      return *this;
+    }
+    virtual BuilderBase& type(const std::string& type)
+    {
+      _library.type(library_type(type));
+      return *this;
+    }
+    virtual BuilderBase& visibility(const std::string& visibility)
+    {
+      _library.visibility(library_visibility(visibility));
+      return *this;
+    }
     virtual BuilderBase& url(const std::string& adr, const std::string& hash)
     {
       _library.url(adr, hash);
       return *this;
     }
+    virtual BuilderBase& url(const std::string& adr, const std::string& hash, const std::string& mode)
+    {
+      if(mode == "shallow"s)
+        _library.url(adr, hash, External::Mode::SHALLOW);
+      else if(mode == "partial"s)
+        _library.url(adr, hash, External::Mode::PARTIAL);
+      else
+        throw std::runtime_error("url: unknown mode '" + mode + "'");
+      return *this;
+    }
+    virtual BuilderBase& sparse(const std::string& path)
+    {
+      _library.sparse(path);
+      return *this;
+    }
     virtual BuilderBase& add_src(const std::string& src)
     {
       _library.add_src(src);
@@ -674,6 +1368,7 @@ class BinaryBuilder : public BuilderBase
       : BuilderBase(project), _binary(Factory<Binary>::create(name))
     {
       _binary.srcs(project.src_path());
+      _binary.input(project.input());
     }
     virtual void ccflag(const std::string& flag) { _binary.ccflags(flag); }
     virtual void cflag(const std::string& flag) { _binary.cflags(flag); }
@@ -698,6 +1393,26 @@ class BinaryBuilder : public BuilderBase
       _binary.ext(extension);
       return *this;
     }
+    virtual BuilderBase& pch(const std::string& header)
+    {
+      _binary.pch(header);
+      return *this;
+    }
+    virtual BuilderBase& unity(int sources)
+    {
+      _binary.unity(sources);
+      return *this;
+    }
+    virtual BuilderBase& nounity(const std::string& source)
+    {
+      _binary.nounity(source);
+      return *this;
+    }
+    virtual BuilderBase& pool(const std::string& name)
+    {
+      _binary.pool(name);
+      return *this;
+    }
     virtual BuilderBase& add_src(const std::string& src)
     {
       _binary.add_src(src);
@@ -752,7 +1467,9 @@ class TemplateBuilder : public BuilderBase
   public:
     TemplateBuilder(Project& project, const std::string& name, const std::string& pattern)
       : BuilderBase(project), _template(Factory<Template, std::string>::create(name, pattern))
-    {}
+    {
+      _template.input(project.input());
+    }
     virtual ~TemplateBuilder() { close(); }
     virtual BuilderBase& incs(const std::string& inc)
     {
@@ -33,20 +33,51 @@ const std::vector<std::string> preamble =
 # limitations under the License.)",
 
 R"(rule COMPILE.cc
- command = c++ $incs ${-D} ${-I} ${-F} $ccflags -MMD -MF $out.d -c -o $out $in
+ command = $rss $launcher c++ $incs ${-D} $variant_defines ${-I} ${-F} $ltoflags $ccflags $variant_ccflags $soflags $debugflags $traceflags $reproflags $pch -MMD -MF $out.d -c -o $out $in
  description = Compile $out
  depfile = $out.d
 
 rule COMPILE.c
- command = cc $incs ${-D} ${-I} $cflags -MMD -MF $out.d  -c -o $out $in
+ command = $rss $launcher cc $incs ${-D} $variant_defines ${-I} $ltoflags $cflags $variant_cflags $soflags $debugflags $traceflags $reproflags $pch -MMD -MF $out.d  -c -o $out $in
  description = Compile $out
  depfile = $out.d
 
+rule PCH.cc
+ command = $rss $launcher c++ $incs ${-D} $variant_defines ${-I} ${-F} $ltoflags $ccflags $variant_ccflags $soflags $reproflags -x c++-header -MMD -MF $out.d -c -o $out $in
+ description = Precompile $out
+ depfile = $out.d
+
+rule PCH.c
+ command = $rss $launcher cc $incs ${-D} $variant_defines ${-I} $ltoflags $cflags $variant_cflags $soflags $reproflags -x c-header -MMD -MF $out.d -c -o $out $in
+ description = Precompile $out
+ depfile = $out.d
+
 rule ARCHIVE
- command = ar cr $out $in
+ command = rm -f $out && $ar $arflags $out $in
  description = Archive $out
 
 rule LINK.cc
- command = c++ $ldflags $in ${-L} ${-l} ${-F} ${-framework} -o $out
- description = Link $out)"
+ command = $rss $link_launcher c++ $linkerflags $ltoldflags $ldflags $variant_ldflags $in ${-L} ${-l} ${-F} ${-framework} $rpath -o $out
+ description = Link $out
+
+rule LINK.so
+ command = $rss $link_launcher c++ -shared $linkerflags $ltoldflags $ldflags $variant_ldflags $in ${-L} ${-l} $soname $rpath -o $out
+ description = Link $out
+
+rule TOC
+)"
+#ifdef __APPLE__
+R"( command = nm -g -U -P $in | cut -d ' ' -f 1,2 > $out.tmp && if cmp -s $out.tmp $out; then rm $out.tmp; else mv $out.tmp $out; fi)"
+#else
+R"( command = nm -D -g -P --defined-only $in | cut -d ' ' -f 1,2 > $out.tmp && if cmp -s $out.tmp $out; then rm $out.tmp; else mv $out.tmp $out; fi)"
+#endif
+R"(
+ description = Interface $out
+ restat = 1
+
+rule REGENERATE
+ command = $m --regenerate
+ description = Regenerate build.ninja
+ generator = 1
+ restat = 1)"
 };
@@ -0,0 +1,945 @@
+// Copyright 2018 Krister Joas <krister@joas.jp>
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <tuple>
+#include <boost/filesystem.hpp>
+
+#include "report.hh"
+
+using namespace std::literals::string_literals;
+
+namespace fs = boost::filesystem;
+
+namespace m {
+namespace {
+// Replaces $builddir in a path of build.ninja.  The result is in the
+// canonical form ninja writes to .ninja_log, without './' in front
+// when the build directory is '.'.
+std::string expand_builddir(const std::string& builddir, const std::string& path)
+{
+  static const std::string var{"$builddir"};
+  if(path.compare(0, var.size(), var) != 0)
+    return path;
+  auto result = fs::path(builddir + path.substr(var.size())).lexically_normal().generic_string();
+  if(result.compare(0, 2, "./") == 0)
+    result.erase(0, 2);
+  return result;
+}
+
+std::string seconds(long ms)
+{
+  std::ostringstream os;
+  os << std::fixed << std::setprecision(2) << ms / 1000.0 << "s";
+  return os.str();
+}
+
+std::string quote(const std::string& s)
+{
+  std::string result{"\""};
+  for(auto c: s)
+  {
+    if(c == '"' || c == '\\')
+      result += '\\';
+    if(static_cast<unsigned char>(c) < 0x20)
+    {
+      std::ostringstream os;
+      os << "\\u" << std::hex << std::setw(4) << std::setfill('0') << static_cast<int>(c);
+      result += os.str();
+    }
+    else
+      result += c;
+  }
+  return result + '"';
+}
+
+// Calls f(target, object) for each object of the project in the
+// default build and in every variant.
+template<typename F>
+void for_each_object(const Project& project, F f)
+{
+  auto objects = [&](const std::string& builddir, const std::string& suffix) {
+    for(const auto& l: project.libraries())
+      if(l->compiled())
+        for(const auto& o: l->objects(project))
+          f("lib " + l->name() + suffix, builddir + o.substr("$builddir"s.size()));
+    for(const auto& b: project.binaries())
+      for(const auto& o: b->objects(project))
+        f("bin " + b->name() + suffix, builddir + o.substr("$builddir"s.size()));
+  };
+  objects(project.builddir(), "");
+  for(const auto& v: project.variants())
+    objects((fs::path(project.builddir()) / v.name()).string(), "@" + v.name());
+}
+
+// Calls f(prerequisite) for each header in a Makefile style depfile
+// written with -MMD.  The first prerequisite is the source itself.
+template<typename F>
+void read_depfile(const std::string& text, F f)
+{
+  auto space = [](char c) { return c == ' ' || c == '\t' || c == '\n' || c == '\r'; };
+  auto p = text.begin();
+  auto end = text.end();
+  while(p != end && !(*p == ':' && (p + 1 == end || space(*(p + 1)))))
+    ++p;
+  if(p == end)
+    throw std::runtime_error("malformed depfile");
+  ++p;
+  bool source = true;
+  std::string path;
+  while(p != end)
+  {
+    if(*p == '\\' && p + 1 != end && (*(p + 1) == '\n' || *(p + 1) == '\r'))
+    {
+      p += 2;
+      continue;
+    }
+    if(*p == '\n')
+      break;
+    if(space(*p))
+    {
+      ++p;
+      continue;
+    }
+    path.clear();
+    while(p != end && !space(*p))
+    {
+      auto start = p;
+      while(p != end && !space(*p) && *p != '\\' && *p != '$')
+        ++p;
+      path.append(start, p);
+      if(p == end || space(*p))
+        break;
+      // Escaped space, '#' or '$'.  A backslash before a newline
+      // continues the line.
+      if(p + 1 != end && ((*p == '\\' && (*(p + 1) == ' ' || *(p + 1) == '#'))
+          || (*p == '$' && *(p + 1) == '$')))
+        ++p;
+      else if(*p == '\\' && p + 1 != end && (*(p + 1) == '\n' || *(p + 1) == '\r'))
+        break;
+      path += *p++;
+    }
+    if(!source)
+      f(path);
+    source = false;
+  }
+}
+
+// Extracts the complete events from a Chrome trace event file as
+// written by -ftime-trace.  Only the fields needed are decoded, the
+// rest of the document is skipped over.
+class TraceParser
+{
+  public:
+    TraceParser(const std::string& text)
+      : _p(text.data()), _end(text.data() + text.size())
+    {}
+    // Calls event(name, detail, duration) for each complete event.
+    template<typename F>
+    void parse(F event)
+    {
+      expect('{');
+      while(member())
+      {
+        if(_key == "traceEvents")
+        {
+          expect('[');
+          if(!close(']'))
+            do
+              trace_event(event);
+            while(next(']'));
+        }
+        else
+          skip();
+      }
+    }
+  private:
+    template<typename F>
+    void trace_event(F event)
+    {
+      std::string name;
+      std::string detail;
+      std::string phase;
+      long duration = 0;
+      expect('{');
+      while(member())
+      {
+        if(_key == "name")
+          string(&name);
+        else if(_key == "ph")
+          string(&phase);
+        else if(_key == "dur")
+          duration = number();
+        else if(_key == "args")
+        {
+          expect('{');
+          while(member())
+            if(_key == "detail")
+              string(&detail);
+            else
+              skip();
+        }
+        else
+          skip();
+      }
+      if(phase == "X")
+        event(name, detail, duration);
+    }
+    // Reads the key of the next member of an object into _key.
+    // Returns false at the end of the object.
+    bool member()
+    {
+      ws();
+      if(_p != _end && *_p == '}')
+      {
+        ++_p;
+        return false;
+      }
+      if(_p != _end && *_p == ',')
+        ++_p;
+      ws();
+      string(&_key);
+      expect(':');
+      return true;
+    }
+    bool close(char c)
+    {
+      ws();
+      if(_p != _end && *_p == c)
+      {
+        ++_p;
+        return true;
+      }
+      return false;
+    }
+    bool next(char c)
+    {
+      ws();
+      if(_p != _end && *_p == ',')
+      {
+        ++_p;
+        return true;
+      }
+      expect(c);
+      return false;
+    }
+    void ws()
+    {
+      while(_p != _end && (*_p == ' ' || *_p == '\n' || *_p == '\r' || *_p == '\t'))
+        ++_p;
+    }
+    void expect(char c)
+    {
+      ws();
+      if(_p == _end || *_p != c)
+        throw std::runtime_error("malformed trace");
+      ++_p;
+    }
+    void string(std::string* result)
+    {
+      expect('"');
+      if(result)
+        result->clear();
+      while(_p != _end && *_p != '"')
+      {
+        if(*_p == '\\' && _end - _p > 1)
+        {
+          ++_p;
+          char c = *_p++;
+          if(c == 'u' && _end - _p >= 4)
+          {
+            auto u = std::stoul(std::string(_p, 4), nullptr, 16);
+            _p += 4;
+            if(result)
+              utf8(u, *result);
+            continue;
+          }
+          if(result)
+            *result += c == 'n' ? '\n' : c == 't' ? '\t' : c == 'r' ? '\r'
+              : c == 'b' ? '\b' : c == 'f' ? '\f' : c;
+        }
+        else
+        {
+          // Copy unescaped characters in one go.
+          auto start = _p;
+          while(_p != _end && *_p != '"' && *_p != '\\')
+            ++_p;
+          if(result)
+            result->append(start, _p);
+        }
+      }
+      expect('"');
+    }
+    static void utf8(unsigned long u, std::string& result)
+    {
+      if(u < 0x80)
+        result += static_cast<char>(u);
+      else if(u < 0x800)
+      {
+        result += static_cast<char>(0xc0 | (u >> 6));
+        result += static_cast<char>(0x80 | (u & 0x3f));
+      }
+      else
+      {
+        result += static_cast<char>(0xe0 | (u >> 12));
+        result += static_cast<char>(0x80 | ((u >> 6) & 0x3f));
+        result += static_cast<char>(0x80 | (u & 0x3f));
+      }
+    }
+    long number()
+    {
+      ws();
+      char* end = nullptr;
+      auto result = std::strtod(_p, &end);
+      if(end == _p)
+        throw std::runtime_error("malformed trace");
+      _p = end;
+      return static_cast<long>(result);
+    }
+    void skip()
+    {
+      ws();
+      if(_p == _end)
+        throw std::runtime_error("malformed trace");
+      if(*_p == '"')
+        string(nullptr);
+      else if(*_p == '{')
+      {
+        ++_p;
+        while(member())
+          skip();
+      }
+      else if(*_p == '[')
+      {
+        ++_p;
+        if(!close(']'))
+          do
+            skip();
+          while(next(']'));
+      }
+      else
+        while(_p != _end && *_p != ',' && *_p != '}' && *_p != ']'
+          && *_p != ' ' && *_p != '\n' && *_p != '\r' && *_p != '\t')
+          ++_p;
+    }
+    const char* _p;
+    const char* _end;
+    std::string _key;
+};
+}
+
+std::vector<LogEntry> read_ninja_log(const std::string& file)
+{
+  std::ifstream in{file};
+  if(!in)
+    throw std::runtime_error("Can't open " + file);
+  std::string line;
+  static const std::string magic{"# ninja log v"};
+  if(!std::getline(in, line) || line.compare(0, magic.size(), magic) != 0
+    || std::atoi(line.c_str() + magic.size()) < 5)
+    throw std::runtime_error(file + ": unsupported log format");
+  // Ninja appends to the log so each run starts over with small times.
+  // The edges of a run are written as they finish, which means a new
+  // run starts when the end time goes down.
+  std::vector<LogEntry> result;
+  std::set<std::tuple<long, long, std::string>> edges;
+  long last = 0;
+  while(std::getline(in, line))
+  {
+    std::istringstream is{line};
+    std::string start, end, mtime, output, hash;
+    if(!std::getline(is, start, '\t') || !std::getline(is, end, '\t')
+      || !std::getline(is, mtime, '\t') || !std::getline(is, output, '\t')
+      || !std::getline(is, hash))
+      continue;
+    LogEntry entry{std::atol(start.c_str()), std::atol(end.c_str()), output};
+    if(entry.end < last)
+    {
+      result.clear();
+      edges.clear();
+    }
+    last = entry.end;
+    if(edges.emplace(entry.start, entry.end, hash).second)
+      result.push_back(entry);
+  }
+  return result;
+}
+
+Profile::Profile(const Project& project, const std::vector<LogEntry>& log)
+  : _cores(std::max(1u, std::thread::hardware_concurrency()))
+{
+  add(project.builddir(), "", project);
+  for(const auto& v: project.variants())
+    add((fs::path(project.builddir()) / v.name()).string(), "@" + v.name(), project);
+  long first = 0;
+  long last = 0;
+  for(const auto& e: log)
+  {
+    if(_time.empty() || e.start < first)
+      first = e.start;
+    last = std::max(last, e.end);
+    auto t = e.end - e.start;
+    _time[e.output] = t;
+    _total += t;
+    auto node = _nodes.find(e.output);
+    if(node == _nodes.end())
+      continue;
+    auto& target = _targets[node->second.target];
+    if(node->second.link)
+      target.link += t;
+    else
+    {
+      target.compile += t;
+      ++target.sources;
+      _sources.emplace_back(e.output, t);
+    }
+  }
+  _wall = last - first;
+  std::stable_sort(_sources.begin(), _sources.end(),
+    [](const auto& a, const auto& b) { return a.second > b.second; });
+  critical_path();
+}
+
+void Profile::add(const std::string& builddir, const std::string& suffix, const Project& project)
+{
+  auto expand = [&builddir](const std::string& path) {
+    return expand_builddir(builddir, path);
+  };
+  // Adds the precompiled header and the objects of a target and
+  // returns the objects.
+  auto objects = [&](const Object& object, const std::string& target) {
+    std::vector<std::string> result;
+    auto pch = expand(object.pch_file(project));
+    if(!pch.empty())
+      _nodes[pch] = Node{target, false, {}};
+    for(const auto& o: object.objects(project))
+    {
+      result.push_back(expand(o));
+      _nodes[result.back()] = Node{target, false, pch.empty() ? std::vector<std::string>{}
+        : std::vector<std::string>{pch}};
+    }
+    return result;
+  };
+  auto dependencies = [&](const Object& object, std::vector<std::string>& deps) {
+    for(const auto& l: object.dependencies())
+      if(l->compiled() && l->type(project) == Library::Type::OBJECTS)
+        for(const auto& o: l->objects(project))
+          deps.push_back(expand(o));
+      else if(l->compiled())
+        deps.push_back(expand(l->dependency(project)));
+  };
+  for(const auto& l: project.libraries())
+  {
+    if(!l->compiled())
+      continue;
+    auto name = "lib " + l->name() + suffix;
+    _targets[name].kind = "lib";
+    _targets[name].name = l->name() + suffix;
+    auto deps = objects(*l, name);
+    if(l->type(project) == Library::Type::OBJECTS)
+      continue;
+    auto file = expand("$builddir/lib/" + l->file(project));
+    if(l->type(project) == Library::Type::SHARED)
+    {
+      dependencies(*l, deps);
+      _nodes[expand(l->dependency(project))] = Node{name, true, {file}};
+    }
+    _nodes[file] = Node{name, true, deps};
+  }
+  for(const auto& b: project.binaries())
+  {
+    auto name = "bin " + b->name() + suffix;
+    _targets[name].kind = "bin";
+    _targets[name].name = b->name() + suffix;
+    auto deps = objects(*b, name);
+    dependencies(*b, deps);
+    _nodes[expand("$builddir/bin/" + b->name())] = Node{name, true, deps};
+  }
+}
+
+// The longest chain of dependent edges of the last build.  Edges not
+// run in the last build count as zero.
+void Profile::critical_path()
+{
+  std::map<std::string, std::pair<long, std::string>> cost;
+  std::function<long(const std::string&)> visit = [&](const std::string& output) -> long {
+    auto c = cost.find(output);
+    if(c != cost.end())
+      return c->second.first;
+    // Guards against cycles.
+    cost[output] = {0, {}};
+    long longest = 0;
+    std::string next;
+    auto node = _nodes.find(output);
+    if(node != _nodes.end())
+      for(const auto& d: node->second.deps)
+      {
+        auto t = visit(d);
+        if(t > longest)
+        {
+          longest = t;
+          next = d;
+        }
+      }
+    auto t = _time.find(output);
+    auto total = longest + (t == _time.end() ? 0 : t->second);
+    cost[output] = {total, next};
+    return total;
+  };
+  std::string start;
+  for(const auto& t: _time)
+    if(visit(t.first) > _critical_time)
+    {
+      _critical_time = visit(t.first);
+      start = t.first;
+    }
+  for(auto i = start; !i.empty(); i = cost[i].second)
+    if(_time.count(i))
+      _critical_path.push_back(i);
+  std::reverse(_critical_path.begin(), _critical_path.end());
+}
+
+void Profile::print(std::ostream& out) const
+{
+  if(_time.empty())
+  {
+    out << "No edges in the last build\n";
+    return;
+  }
+  auto parallelism = _wall > 0 ? static_cast<double>(_total) / _wall : 0.0;
+  out << "Build: " << seconds(_wall) << " wall, " << seconds(_total) << " of work on "
+    << _cores << " cores, parallelism " << std::fixed << std::setprecision(1) << parallelism
+    << " (" << static_cast<int>(parallelism * 100 / _cores) << "% of cores)\n";
+  out << "\nSlowest translation units:\n";
+  for(std::size_t i = 0; i != _sources.size() && i != 10; ++i)
+    out << std::setw(10) << seconds(_sources[i].second) << "  " << _sources[i].first
+      << "  (" << _nodes.at(_sources[i].first).target << ")\n";
+  std::vector<const Target*> targets;
+  for(const auto& t: _targets)
+    if(t.second.compile + t.second.link > 0)
+      targets.push_back(&t.second);
+  std::stable_sort(targets.begin(), targets.end(), [](const auto* a, const auto* b) {
+      return a->compile + a->link > b->compile + b->link;
+    });
+  out << "\nTargets:\n" << std::setw(10) << "compile" << std::setw(10) << "link"
+    << std::setw(9) << "sources" << "  target\n";
+  for(const auto* t: targets)
+    out << std::setw(10) << seconds(t->compile) << std::setw(10) << seconds(t->link)
+      << std::setw(9) << t->sources << "  " << t->kind << " " << t->name << '\n';
+  out << "\nCritical path: " << seconds(_critical_time) << '\n';
+  for(const auto& i: _critical_path)
+    out << std::setw(10) << seconds(_time.at(i)) << "  " << i << '\n';
+}
+
+void Profile::json(std::ostream& out) const
+{
+  out << "{\n  \"wall_ms\": " << _wall << ",\n  \"work_ms\": " << _total
+    << ",\n  \"cores\": " << _cores << ",\n  \"sources\": [";
+  const char* sep = "\n";
+  for(const auto& s: _sources)
+  {
+    out << sep << "    {\"output\": " << quote(s.first) << ", \"target\": "
+      << quote(_nodes.at(s.first).target) << ", \"ms\": " << s.second << "}";
+    sep = ",\n";
+  }
+  out << "\n  ],\n  \"targets\": [";
+  sep = "\n";
+  for(const auto& t: _targets)
+  {
+    if(t.second.compile + t.second.link == 0)
+      continue;
+    out << sep << "    {\"kind\": " << quote(t.second.kind) << ", \"name\": " << quote(t.second.name)
+      << ", \"compile_ms\": " << t.second.compile << ", \"link_ms\": " << t.second.link
+      << ", \"sources\": " << t.second.sources << "}";
+    sep = ",\n";
+  }
+  out << "\n  ],\n  \"critical_path\": {\"ms\": " << _critical_time << ", \"edges\": [";
+  sep = "\n";
+  for(const auto& i: _critical_path)
+  {
+    out << sep << "    {\"output\": " << quote(i) << ", \"ms\": " << _time.at(i) << "}";
+    sep = ",\n";
+  }
+  out << "\n  ]}\n}\n";
+}
+
+void TimeReport::Totals::merge(const Totals& other)
+{
+  for(const auto& h: other.headers)
+  {
+    headers[h.first].us += h.second.us;
+    headers[h.first].count += h.second.count;
+  }
+  for(const auto& t: other.templates)
+  {
+    templates[t.first].us += t.second.us;
+    templates[t.first].count += t.second.count;
+  }
+}
+
+TimeReport::TimeReport(const Project& project, unsigned jobs)
+{
+  // Clang names the trace after the object file.
+  std::vector<std::pair<std::string, std::string>> traces;
+  for_each_object(project, [&traces](const std::string& target, const std::string& object) {
+      auto trace = object.substr(0, object.size() - 2) + ".json";
+      if(fs::exists(trace))
+        traces.emplace_back(target, trace);
+    });
+  _files = traces.size();
+  std::atomic<std::size_t> next{0};
+  std::mutex mutex;
+  std::vector<std::string> errors;
+  auto worker = [&]() {
+    std::map<std::string, Totals> targets;
+    std::string text;
+    for(auto i = next++; i < traces.size(); i = next++)
+    {
+      auto& totals = targets[traces[i].first];
+      try
+      {
+        std::ifstream in{traces[i].second, std::ios::binary};
+        text.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        TraceParser(text).parse(
+          [&totals](const std::string& name, const std::string& detail, long duration) {
+            Costs* costs = nullptr;
+            if(name == "Source")
+              costs = &totals.headers;
+            else if(name == "InstantiateClass" || name == "InstantiateFunction")
+              costs = &totals.templates;
+            else
+              return;
+            auto& cost = (*costs)[detail];
+            cost.us += duration;
+            ++cost.count;
+          });
+      }
+      catch(const std::exception& e)
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        errors.push_back(traces[i].second + ": " + e.what());
+      }
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    for(const auto& t: targets)
+    {
+      _targets[t.first].merge(t.second);
+      _all.merge(t.second);
+    }
+  };
+  jobs = std::max(1u, std::min<unsigned>(jobs, traces.size()));
+  std::vector<std::thread> threads;
+  for(unsigned i = 1; i < jobs; ++i)
+    threads.emplace_back(worker);
+  worker();
+  for(auto& t: threads)
+    t.join();
+  for(const auto& e: errors)
+    std::cerr << e << '\n';
+}
+
+namespace {
+using Ranked = std::vector<std::pair<std::string, std::pair<long, int>>>;
+
+template<typename Costs>
+Ranked rank(const Costs& costs, std::size_t n)
+{
+  Ranked result;
+  for(const auto& c: costs)
+    result.emplace_back(c.first, std::make_pair(c.second.us, c.second.count));
+  std::sort(result.begin(), result.end(), [](const auto& a, const auto& b) {
+      return a.second.first != b.second.first ? a.second.first > b.second.first
+        : a.first < b.first;
+    });
+  if(result.size() > n)
+    result.resize(n);
+  return result;
+}
+
+void print_ranked(std::ostream& out, const Ranked& ranked, const std::string& indent)
+{
+  for(const auto& r: ranked)
+    out << indent << std::setw(10) << seconds(r.second.first / 1000) << std::setw(7)
+      << r.second.second << "x  " << r.first << '\n';
+}
+
+void json_ranked(std::ostream& out, const Ranked& ranked)
+{
+  out << "[";
+  const char* sep = "\n";
+  for(const auto& r: ranked)
+  {
+    out << sep << "      {\"name\": " << quote(r.first) << ", \"us\": " << r.second.first
+      << ", \"count\": " << r.second.second << "}";
+    sep = ",\n";
+  }
+  out << "]";
+}
+}
+
+void TimeReport::print(std::ostream& out) const
+{
+  if(_files == 0)
+  {
+    out << "No time traces found, compile with 'time_trace' and Clang\n";
+    return;
+  }
+  out << "Time traces: " << _files << " translation units\n";
+  out << "\nHeaders by total parse time, including the headers they include:\n";
+  print_ranked(out, rank(_all.headers, 20), "");
+  out << "\nTemplates by total instantiation time:\n";
+  print_ranked(out, rank(_all.templates, 20), "");
+  for(const auto& t: _targets)
+  {
+    out << "\n" << t.first << "\n  headers:\n";
+    print_ranked(out, rank(t.second.headers, 5), "  ");
+    out << "  templates:\n";
+    print_ranked(out, rank(t.second.templates, 5), "  ");
+  }
+}
+
+void TimeReport::json(std::ostream& out) const
+{
+  out << "{\n  \"files\": " << _files << ",\n  \"headers\": ";
+  json_ranked(out, rank(_all.headers, 100));
+  out << ",\n  \"templates\": ";
+  json_ranked(out, rank(_all.templates, 100));
+  out << ",\n  \"targets\": {";
+  const char* sep = "\n";
+  for(const auto& t: _targets)
+  {
+    out << sep << "    " << quote(t.first) << ": {\"headers\": ";
+    json_ranked(out, rank(t.second.headers, 100));
+    out << ", \"templates\": ";
+    json_ranked(out, rank(t.second.templates, 100));
+    out << "}";
+    sep = ",\n";
+  }
+  out << "\n  }\n}\n";
+}
+
+DepsReport::DepsReport(const Project& project, const std::vector<LogEntry>& log, unsigned jobs)
+{
+  std::unordered_map<std::string, long> time;
+  for(const auto& e: log)
+    time[e.output] = e.end - e.start;
+  _timed = !time.empty();
+  add(project.builddir(), "", project, time);
+  for(const auto& v: project.variants())
+    add((fs::path(project.builddir()) / v.name()).string(), "@" + v.name(), project, time);
+
+  // Each thread maps the headers it sees to the objects including
+  // them.  The maps are merged at the end.
+  using Includes = std::unordered_map<std::string, std::vector<std::uint32_t>>;
+  Includes includes;
+  std::atomic<std::size_t> next{0};
+  std::atomic<std::size_t> depfiles{0};
+  std::mutex mutex;
+  std::vector<std::string> errors;
+  auto worker = [&]() {
+    Includes local;
+    std::string text;
+    for(auto i = next++; i < _objects.size(); i = next++)
+    {
+      auto depfile = _objects[i].first + ".d";
+      std::ifstream in{depfile, std::ios::binary};
+      if(!in)
+        continue;
+      text.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+      try
+      {
+        read_depfile(text, [&local, i](const std::string& header) {
+            local[header].push_back(static_cast<std::uint32_t>(i));
+          });
+        ++depfiles;
+      }
+      catch(const std::exception& e)
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        errors.push_back(depfile + ": " + e.what());
+      }
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    if(includes.empty())
+      includes.swap(local);
+    else
+      for(auto& h: local)
+      {
+        auto& objects = includes[h.first];
+        objects.insert(objects.end(), h.second.begin(), h.second.end());
+      }
+  };
+  jobs = std::max(1u, std::min<unsigned>(jobs, _objects.size()));
+  std::vector<std::thread> threads;
+  for(unsigned i = 1; i < jobs; ++i)
+    threads.emplace_back(worker);
+  worker();
+  for(auto& t: threads)
+    t.join();
+  for(const auto& e: errors)
+    std::cerr << e << '\n';
+  _depfiles = depfiles;
+
+  // Unity files include sources relative to their own directory, so
+  // the same header can be spelled differently in different depfiles.
+  Includes headers;
+  for(auto& h: includes)
+  {
+    auto& objects = headers[fs::path(h.first).lexically_normal().string()];
+    if(objects.empty())
+      objects.swap(h.second);
+    else
+    {
+      objects.insert(objects.end(), h.second.begin(), h.second.end());
+      std::sort(objects.begin(), objects.end());
+      objects.erase(std::unique(objects.begin(), objects.end()), objects.end());
+    }
+  }
+
+  // Marks the targets already counted for the current header.
+  std::vector<std::size_t> seen(_targets.size(), 0);
+  std::size_t mark = 0;
+  std::vector<std::size_t> libraries;
+  _headers.reserve(headers.size());
+  for(const auto& h: headers)
+  {
+    ++mark;
+    Header header;
+    header.name = h.first;
+    header.objects = h.second.size();
+    auto count = [&](std::size_t t, bool relink) {
+      if(seen[t] == mark)
+        return false;
+      seen[t] = mark;
+      ++(_targets[t].binary ? header.binaries : header.libraries);
+      if(relink)
+        header.cost += _targets[t].link;
+      return true;
+    };
+    libraries.clear();
+    for(auto o: h.second)
+    {
+      header.cost += _compile[o];
+      auto t = _objects[o].second;
+      if(count(t, true) && !_targets[t].binary)
+        libraries.push_back(t);
+    }
+    // Binaries using a shared library are only relinked when its
+    // interface changes.
+    for(auto l: libraries)
+      for(auto u: _targets[l].users)
+        count(u, !_targets[l].shared);
+    _headers.push_back(std::move(header));
+  }
+  std::sort(_headers.begin(), _headers.end(), [](const auto& a, const auto& b) {
+      if(a.cost != b.cost)
+        return a.cost > b.cost;
+      if(a.objects != b.objects)
+        return a.objects > b.objects;
+      return a.name < b.name;
+    });
+}
+
+void DepsReport::add(const std::string& builddir, const std::string& suffix,
+  const Project& project, const std::unordered_map<std::string, long>& time)
+{
+  auto expand = [&builddir](const std::string& path) {
+    return expand_builddir(builddir, path);
+  };
+  auto duration = [&time](const std::string& output) {
+    auto t = time.find(output);
+    return t == time.end() ? 0 : t->second;
+  };
+  auto objects = [&](const Object& object) {
+    for(const auto& o: object.objects(project))
+    {
+      auto path = expand(o);
+      _compile.push_back(duration(path));
+      _objects.emplace_back(std::move(path), _targets.size() - 1);
+    }
+  };
+  std::map<std::string, std::size_t> libraries;
+  for(const auto& l: project.libraries())
+  {
+    if(!l->compiled())
+      continue;
+    libraries[l->name()] = _targets.size();
+    _targets.push_back(Target{"lib " + l->name() + suffix, false,
+      l->type(project) == Library::Type::SHARED,
+      duration(expand("$builddir/lib/" + l->file(project))), {}});
+    objects(*l);
+  }
+  for(const auto& b: project.binaries())
+  {
+    auto index = _targets.size();
+    _targets.push_back(Target{"bin " + b->name() + suffix, true, false,
+      duration(expand("$builddir/bin/" + b->name())), {}});
+    objects(*b);
+    for(const auto& l: b->dependencies())
+    {
+      auto library = libraries.find(l->name());
+      if(library != libraries.end())
+        _targets[library->second].users.push_back(index);
+    }
+  }
+}
+
+void DepsReport::print(std::ostream& out) const
+{
+  if(_depfiles == 0)
+  {
+    out << "No depfiles found, build the project first\n";
+    return;
+  }
+  out << "Depfiles: " << _depfiles << " of " << _objects.size() << " objects, "
+    << _headers.size() << " headers\n";
+  if(!_timed)
+    out << "No .ninja_log, rebuild costs are unknown\n";
+  out << "\nHeaders by estimated rebuild cost:\n"
+    << std::setw(10) << "cost" << std::setw(9) << "objects" << std::setw(6) << "libs"
+    << std::setw(6) << "bins" << "  header\n";
+  std::size_t n = 0;
+  for(const auto& h: _headers)
+  {
+    if(n++ == 30)
+      break;
+    out << std::setw(10) << seconds(h.cost) << std::setw(9) << h.objects << std::setw(6)
+      << h.libraries << std::setw(6) << h.binaries << "  " << h.name << '\n';
+  }
+}
+
+void DepsReport::json(std::ostream& out) const
+{
+  out << "{\n  \"depfiles\": " << _depfiles << ",\n  \"objects\": " << _objects.size()
+    << ",\n  \"headers\": [";
+  const char* sep = "\n";
+  for(const auto& h: _headers)
+  {
+    out << sep << "    {\"name\": " << quote(h.name) << ", \"objects\": " << h.objects
+      << ", \"libraries\": " << h.libraries << ", \"binaries\": " << h.binaries
+      << ", \"cost_ms\": " << h.cost << "}";
+    sep = ",\n";
+  }
+  out << "]\n}\n";
+}
+}
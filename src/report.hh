@@ -0,0 +1,140 @@
+// Copyright 2018 Krister Joas <krister@joas.jp>
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <iostream>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "m.hh"
+
+namespace m {
+// An edge of the most recent build as recorded in .ninja_log.  Times
+// are in milliseconds since ninja started.
+struct LogEntry
+{
+  long start;
+  long end;
+  std::string output;
+};
+
+// Reads the edges of the most recent run from a version 5 ninja log.
+// An edge with several outputs is only returned once.
+std::vector<LogEntry> read_ninja_log(const std::string& file);
+
+// Build times of the last build per source, library and binary for
+// 'm --profile'.  The outputs in the log are mapped to targets, and
+// the critical path is found, using the dependencies in the project.
+class Profile
+{
+  public:
+    Profile(const Project& project, const std::vector<LogEntry>& log);
+    void print(std::ostream&) const;
+    void json(std::ostream&) const;
+  private:
+    struct Node
+    {
+      std::string target;
+      bool link;
+      std::vector<std::string> deps;
+    };
+    struct Target
+    {
+      std::string kind;
+      std::string name;
+      long compile = 0;
+      long link = 0;
+      int sources = 0;
+    };
+    void add(const std::string& builddir, const std::string& suffix, const Project& project);
+    void critical_path();
+    std::map<std::string, Node> _nodes;
+    std::map<std::string, long> _time;
+    std::map<std::string, Target> _targets;
+    std::vector<std::pair<std::string, long>> _sources;
+    std::vector<std::string> _critical_path;
+    long _critical_time = 0;
+    long _wall = 0;
+    long _total = 0;
+    unsigned _cores;
+};
+
+// Header parsing and template instantiation times from the traces
+// written by Clang's -ftime-trace, summed over all translation units
+// and per target for 'm --time-report'.  The trace files are parsed
+// in parallel in a single pass without building a document tree.
+class TimeReport
+{
+  public:
+    TimeReport(const Project& project, unsigned jobs);
+    void print(std::ostream&) const;
+    void json(std::ostream&) const;
+  private:
+    struct Cost
+    {
+      long us = 0;
+      int count = 0;
+    };
+    using Costs = std::unordered_map<std::string, Cost>;
+    struct Totals
+    {
+      Costs headers;
+      Costs templates;
+      void merge(const Totals&);
+    };
+    std::map<std::string, Totals> _targets;
+    Totals _all;
+    std::size_t _files = 0;
+};
+
+// How many objects, libraries and binaries depend on each header and
+// what it costs to rebuild them when the header changes, for 'm
+// --deps'.  The headers come from the depfiles the compiler writes
+// next to the objects and the costs from the durations in the log.
+class DepsReport
+{
+  public:
+    DepsReport(const Project& project, const std::vector<LogEntry>& log, unsigned jobs);
+    void print(std::ostream&) const;
+    void json(std::ostream&) const;
+  private:
+    struct Target
+    {
+      std::string name;
+      bool binary;
+      bool shared;
+      long link = 0;
+      // The binaries linking a library.
+      std::vector<std::size_t> users;
+    };
+    struct Header
+    {
+      std::string name;
+      std::size_t objects = 0;
+      std::size_t libraries = 0;
+      std::size_t binaries = 0;
+      long cost = 0;
+    };
+    void add(const std::string& builddir, const std::string& suffix, const Project& project,
+      const std::unordered_map<std::string, long>& time);
+    std::vector<Target> _targets;
+    std::vector<std::pair<std::string, std::size_t>> _objects;
+    std::vector<long> _compile;
+    std::vector<Header> _headers;
+    std::size_t _depfiles = 0;
+    bool _timed = false;
+};
+}
@@ -0,0 +1,173 @@
+// Copyright 2018 Krister Joas <krister@joas.jp>
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <boost/filesystem.hpp>
+
+#include "state.hh"
+
+using namespace std::literals::string_literals;
+
+namespace m {
+namespace {
+const std::string magic{"m-state 2"};
+}
+
+State::State(const std::string& builddir)
+  : _file(fs::path(builddir) / ".m" / "state"), _start(std::time(nullptr))
+{}
+
+bool State::fingerprint(const std::string& path, Fingerprint& result)
+{
+  boost::system::error_code ec;
+  auto status = fs::status(path, ec);
+  if(ec || !fs::exists(status))
+    return false;
+  result.mtime = fs::last_write_time(path, ec);
+  if(ec)
+    return false;
+  result.size = fs::is_regular_file(status) ? fs::file_size(path, ec) : 0;
+  return !ec;
+}
+
+// A hash of the names of the subdirectories of 'dir' and of 'file' if
+// it's there.
+bool State::listing(const std::string& dir, const std::string& file, std::uint64_t& result)
+{
+  boost::system::error_code ec;
+  std::vector<std::string> names;
+  for(fs::directory_iterator d(dir, ec), end; !ec && d != end; d.increment(ec))
+  {
+    boost::system::error_code status_ec;
+    auto name = d->path().filename().string();
+    if(fs::is_directory(d->symlink_status(status_ec)))
+      names.push_back(name + '/');
+    else if(name == file && fs::is_regular_file(d->status(status_ec)))
+      names.push_back(name);
+  }
+  if(ec)
+    return false;
+  std::sort(names.begin(), names.end());
+  // FNV-1a, with a separator after each name.
+  result = 14695981039346656037ULL;
+  for(const auto& name: names)
+    for(unsigned char c: name + '\n')
+    {
+      result ^= c;
+      result *= 1099511628211ULL;
+    }
+  return true;
+}
+
+bool State::unchanged() const
+{
+  std::ifstream in{_file.string()};
+  std::string line;
+  if(!in || !std::getline(in, line) || line != magic)
+    return false;
+  std::time_t saved = 0;
+  std::vector<std::string> args;
+  std::string find;
+  bool inputs = false;
+  while(std::getline(in, line))
+  {
+    std::istringstream is{line};
+    std::string key;
+    is >> key;
+    if(key == "time"s)
+      is >> saved;
+    else if(key == "arg"s)
+      args.push_back(line.substr(key.size() + 1));
+    else if(key == "find"s)
+      is >> find;
+    else if(key == "dir"s)
+    {
+      Fingerprint recorded;
+      std::uint64_t entries = 0;
+      is >> recorded.mtime >> entries;
+      std::string path;
+      std::getline(is >> std::ws, path);
+      Fingerprint current;
+      if(!fingerprint(path, current))
+        return false;
+      // A changed directory only matters if its list of
+      // subdirectories, or whether it holds the file, has changed.
+      std::uint64_t now = 0;
+      if((current.mtime != recorded.mtime || current.mtime >= saved)
+        && (!listing(path, find, now) || now != entries))
+        return false;
+    }
+    else if(key == "input"s)
+    {
+      Fingerprint recorded;
+      is >> recorded.mtime >> recorded.size;
+      std::string path;
+      std::getline(is >> std::ws, path);
+      Fingerprint current;
+      if(!fingerprint(path, current))
+        return false;
+      // A file modified in the same second as the state was saved may
+      // have changed again without its mtime changing.
+      if(current.mtime != recorded.mtime || current.size != recorded.size
+        || current.mtime >= saved)
+        return false;
+      inputs = true;
+    }
+    else
+      return false;
+  }
+  return inputs && args == _args;
+}
+
+void State::save() const
+{
+  fs::create_directories(_file.parent_path());
+  auto tmp = _file;
+  tmp += ".tmp";
+  {
+    std::ofstream out{tmp.string()};
+    if(!out)
+      throw std::runtime_error("Can't open " + tmp.string() + " for writing");
+    out << magic << '\n';
+    out << "time " << _start << '\n';
+    for(const auto& arg: _args)
+      out << "arg " << arg << '\n';
+    for(const auto& input: _inputs)
+    {
+      Fingerprint f;
+      if(fingerprint(input, f))
+        out << "input " << f.mtime << ' ' << f.size << ' ' << input << '\n';
+    }
+    if(!_directories.empty())
+      out << "find " << _find << '\n';
+    for(const auto& dir: _directories)
+    {
+      Fingerprint f;
+      std::uint64_t entries = 0;
+      if(!fingerprint(dir, f) || !listing(dir, _find, entries))
+        continue;
+      // The directory may have changed after it was scanned, so its
+      // listing now can't be trusted.  0 makes the next run compare
+      // as changed.
+      if(f.mtime >= _start)
+        entries = 0;
+      out << "dir " << f.mtime << ' ' << entries << ' ' << dir << '\n';
+    }
+  }
+  fs::rename(tmp, _file);
+}
+}
@@ -0,0 +1,62 @@
+// Copyright 2018 Krister Joas <krister@joas.jp>
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <boost/filesystem.hpp>
+
+namespace fs = boost::filesystem;
+
+namespace m {
+// Records what the last generation of build.ninja depended on: the
+// arguments affecting the output and the fingerprints of every file
+// and directory read while loading the '_m' files.  If nothing has
+// changed since then there is no need to parse the '_m' files again.
+class State
+{
+  public:
+    State(const std::string& builddir);
+    void args(const std::vector<std::string>& args) { _args = args; }
+    void inputs(const std::vector<std::string>& inputs) { _inputs = inputs; }
+    // The directories searched for files named 'file'.  Only which
+    // subdirectories they have, and whether they hold 'file', is
+    // compared, so other files coming and going, e.g. editor swap
+    // files, don't make 'm' read the '_m' files again.
+    void directories(const std::vector<std::string>& dirs, const std::string& file)
+    {
+      _directories = dirs;
+      _find = file;
+    }
+    bool unchanged() const;
+    void save() const;
+  private:
+    struct Fingerprint
+    {
+      std::time_t mtime;
+      std::uintmax_t size;
+    };
+    static bool fingerprint(const std::string& path, Fingerprint& result);
+    static bool listing(const std::string& dir, const std::string& file, std::uint64_t& result);
+    const fs::path _file;
+    const std::time_t _start;
+    std::vector<std::string> _args;
+    std::vector<std::string> _inputs;
+    std::vector<std::string> _directories;
+    std::string _find;
+};
+}